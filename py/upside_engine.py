@@ -30,6 +30,9 @@ calc.evaluate_energy.argtypes = [ct.c_void_p, ct.c_void_p, ct.c_void_p]
 calc.evaluate_deriv.restype  = ct.c_int
 calc.evaluate_deriv.argtypes = [ct.c_void_p, ct.c_void_p, ct.c_void_p]
 
+calc.evaluate_energy_only.restype  = ct.c_int
+calc.evaluate_energy_only.argtypes = [ct.c_void_p, ct.c_void_p, ct.c_void_p]
+
 calc.set_param.restype  = ct.c_int
 calc.set_param.argtypes = [ct.c_int, ct.c_void_p, ct.c_void_p, ct.c_char_p]
 
@@ -177,6 +180,15 @@ class Upside(object):
         if retcode: raise RuntimeError('Unable to evaluate energy')
         return energy[0]
 
+    def energy_only(self, pos):
+        # faster than energy, but get_sens is not valid afterward
+        pos = np.require(pos, dtype='f4', requirements='C')
+        assert pos.shape == (self.n_atom,3)
+        energy = np.zeros(1, dtype='f4')
+        retcode = calc.evaluate_energy_only(energy.ctypes.data, self.engine, pos.ctypes.data)
+        if retcode: raise RuntimeError('Unable to evaluate energy')
+        return energy[0]
+
     def deriv(self, pos):
         pos = np.require(pos, dtype='f4', requirements='C')
         assert pos.shape == (self.n_atom,3)
@@ -0,0 +1,79 @@
+#include "arena.h"
+#include <sys/mman.h>
+#include <unistd.h>
+#include <cstring>
+#include <string>
+#include <algorithm>
+
+using namespace std;
+
+static const size_t huge_page_size = size_t(2)<<20;
+
+static size_t round_up_size(size_t n, size_t alignment) {
+    return ((n+alignment-1)/alignment)*alignment;
+}
+
+EngineArena::EngineArena(bool huge_pages_):
+    huge_pages(huge_pages_),
+    min_chunk_size(size_t(4)<<20)
+{}
+
+
+EngineArena::~EngineArena() {
+    for(auto& c: chunks) munmap(c.base, c.size);
+}
+
+
+void* EngineArena::allocate(size_t n_bytes, size_t alignment) {
+    if(!n_bytes) n_bytes = 1;
+    for(auto& c: chunks) {
+        size_t start = round_up_size(c.used, alignment);
+        if(start+n_bytes <= c.size) {
+            c.used = start+n_bytes;
+            return c.base+start;
+        }
+    }
+
+    // Transparent huge pages are only used for 2MB-aligned regions, so over-allocate and
+    // trim the mapping to alignment in that case
+    size_t size = round_up_size(max(n_bytes+alignment, min_chunk_size), huge_page_size);
+    size_t map_size = huge_pages ? size+huge_page_size : size;
+    void* p = mmap(nullptr, map_size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if(p==MAP_FAILED) throw string("unable to map ") + to_string(map_size) + " bytes for engine arena";
+
+    char* base = static_cast<char*>(p);
+    if(huge_pages) {
+        char* aligned = reinterpret_cast<char*>(round_up_size(reinterpret_cast<size_t>(base), huge_page_size));
+        if(aligned!=base) munmap(base, aligned-base);
+        size_t tail = (base+map_size) - (aligned+size);
+        if(tail) munmap(aligned+size, tail);
+        base = aligned;
+#ifdef MADV_HUGEPAGE
+        madvise(base, size, MADV_HUGEPAGE);
+#endif
+    }
+
+    chunks.push_back(Chunk{base, size, 0u});
+    return allocate(n_bytes, alignment);
+}
+
+
+size_t EngineArena::bytes_used() const {
+    size_t total = 0u;
+    for(auto& c: chunks) total += c.used;
+    return total;
+}
+
+
+void EngineArena::first_touch() {
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    vector<char> tmp;
+    for(auto& c: chunks) {
+        size_t n = round_up_size(c.used, page_size);
+        if(!n) continue;
+        tmp.assign(c.base, c.base+n);
+        // discarded pages of a private anonymous mapping are zero-filled on the next access
+        if(madvise(c.base, n, MADV_DONTNEED)) continue;
+        memcpy(c.base, tmp.data(), n);
+    }
+}
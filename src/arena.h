@@ -0,0 +1,61 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <vector>
+#include <cstddef>
+
+//! \brief Bump allocator that packs the buffers of a DerivEngine into a few large mappings
+//!
+//! Memory is obtained in chunks with mmap and is only released when the arena is destroyed,
+//! so an arena must outlive every buffer allocated from it.  A buffer that is replaced by a
+//! larger one (see resize_aligned) leaves its old allocation unused in the arena.  Edge buffers
+//! grow by at least half their size, so this waste is bounded by a constant factor of the
+//! final sizes.  Allocation is not thread-safe, so an arena must only be current on the single
+//! thread that constructs or runs its engine.  Buffers held in std::vector's are not covered.
+struct EngineArena {
+    struct Chunk {
+        char*  base;
+        size_t size;
+        size_t used;
+    };
+
+    std::vector<Chunk> chunks;
+    bool huge_pages;
+    size_t min_chunk_size;
+
+    //! \brief Create an empty arena, optionally advising the kernel to back it with huge pages
+    EngineArena(bool huge_pages_=false);
+    EngineArena(const EngineArena&) = delete;
+    EngineArena& operator=(const EngineArena&) = delete;
+    ~EngineArena();
+
+    //! \brief Allocate n_bytes of zero-initialized memory aligned to alignment bytes
+    void* allocate(size_t n_bytes, size_t alignment);
+
+    //! \brief Total bytes handed out by allocate
+    size_t bytes_used() const;
+
+    //! \brief Move the pages of the arena to the memory of the calling thread
+    //!
+    //! Under the Linux first-touch policy, a page is placed on the NUMA node of the thread that
+    //! first writes it.  Engines are initialized serially, so this should be called by the
+    //! thread that will later run the engine.  The contents are copied out, the pages are
+    //! discarded, and the contents are written back by the calling thread.  Addresses of
+    //! allocations are unchanged.
+    void first_touch();
+};
+
+//! \brief Arena used by new_aligned on the current thread (nullptr for the ordinary heap)
+inline EngineArena*& current_arena() {
+    static thread_local EngineArena* arena = nullptr;
+    return arena;
+}
+
+//! \brief Direct new_aligned allocations on this thread to an arena for the lifetime of the scope
+struct ArenaScope {
+    EngineArena* previous;
+    ArenaScope(EngineArena* arena): previous(current_arena()) {current_arena() = arena;}
+    ~ArenaScope() {current_arena() = previous;}
+};
+
+#endif
@@ -47,14 +47,14 @@ struct BackbonePairs : public PotentialNode
     vector<AffineParams> params;
     vector<RefPos> ref_pos;
     PairlistComputation<true> pairlist;
-    unique_ptr<int32_t[]> id;
+    aligned_array<int32_t> id;
     float dist_cutoff;
 
     BackbonePairs(hid_t grp, CoordNode& alignment_):
         PotentialNode(),
         n_residue(get_dset_size(1, grp, "id")[0]), alignment(alignment_), 
         params(n_residue), ref_pos(n_residue),
-        pairlist(n_residue, n_residue, (n_residue*(n_residue-1))/2),
+        pairlist(n_residue, n_residue, all_pairs_n_edge(n_residue, n_residue, true), acceptable_backbone_pair),
         id(new_aligned<int32_t>(n_residue,16))
     {
         check_elem_width(alignment, 7);
@@ -76,12 +76,14 @@ struct BackbonePairs : public PotentialNode
                 max_atom_dev = max(mag(p.pos[na]), max_atom_dev);
 
         dist_cutoff = 2*max_atom_dev + sqrtf(nonbonded_atom_cutoff2);
+        pairlist.set_cutoff(dist_cutoff);
+        pairlist.add_stats_logger(object_basename(grp));
     }
 
     virtual void compute_value(ComputeMode mode) {
         Timer timer(string("backbone_pairs"));
 
-        float* pot = mode==PotentialAndDerivMode ? &potential : nullptr;
+        float* pot = potential_needed(mode) ? &potential : nullptr;
         VecArrayStorage coords(3,round_up(n_residue,4));
         vector<int>    ref_pos_atoms (n_residue);
         vector<float3> ref_pos_coords(n_residue*4);
@@ -99,7 +101,7 @@ struct BackbonePairs : public PotentialNode
         }
 
         // acceptable_backbone_pair checks that nr2>=nr1+2
-        pairlist.template find_edges<acceptable_backbone_pair>(dist_cutoff,
+        pairlist.template find_edges<acceptable_backbone_pair>(
                 coords.x.get(), coords.row_width, id.get(),
                 coords.x.get(), coords.row_width, id.get());
         int n_edge = pairlist.n_edge;
@@ -141,6 +141,9 @@ namespace {
         constexpr static bool  symmetric = true;
         constexpr static int   n_param=N_KNOT_SC_SC, n_dim1=3, n_dim2=3, simd_width=1;  // 8 angstrom cutoff
 
+        static const char* jit_header() {return "bead_interaction.h";}
+        static const char* jit_name()   {return "PosDistSplineInteraction";}
+
         static float cutoff(const float* p) {
             return (n_param-2-1e-6)/inv_dx;  // 1e-6 just insulates us from round-off error
         }
@@ -188,6 +191,9 @@ namespace {
         constexpr static int   n_param=2*n_knot_angular+2*n_knot, n_dim1=6, n_dim2=6, simd_width=1;
         constexpr static float inv_dx = 1.f/KNOT_SPACING, inv_dtheta = (n_knot_angular-3)/2.f;
 
+        static const char* jit_header() {return "bead_interaction.h";}
+        static const char* jit_name()   {return "PosQuadSplineInteraction";}
+
         static float cutoff(const float* p) {
             return (n_knot-2-1e-6)/inv_dx;  // 1e-6 insulates from roundoff
         }
@@ -34,7 +34,7 @@ struct PosSpring : public PotentialNode
 
     virtual void compute_value(ComputeMode mode) {
         Timer timer(string("pos_spring")); 
-        float* pot = mode==PotentialAndDerivMode ? &potential : nullptr;
+        float* pot = potential_needed(mode) ? &potential : nullptr;
         VecArray posc = pos.output;
         VecArray pos_sens = pos.sens;
 
@@ -164,6 +164,8 @@ struct AFMPotential : public PotentialNode
         }
         potential = pot;
     }
+
+    virtual bool memoizable() const override {return false;}
 };
 static RegisterNodeType<AFMPotential,1> AFM_node("AFM");
 
@@ -175,10 +177,11 @@ struct RamaCoord : public CoordNode
 
     CoordNode& pos;
     vector<Params> params;
-    unique_ptr<Jac[]> jac;
+    aligned_array<Jac> jac;
 
     RamaCoord(hid_t grp, CoordNode& pos_):
-        CoordNode(get_dset_size(2, grp, "id")[0], 2),
+        // SoA halves the storage of the width-2 output
+        CoordNode(get_dset_size(2, grp, "id")[0], 2, Layout::SoA),
         pos(pos_),
         params(n_elem),
         jac(new_aligned<Jac>(n_elem,1))
@@ -198,14 +201,14 @@ struct RamaCoord : public CoordNode
 
         if(logging(LOG_DETAILED)) {
             default_logger->add_logger<float>("rama", {n_elem,2}, [&](float* buffer) {
-                    copy_vec_array_to_buffer(output, n_elem,2, buffer);});
+                    copy_vec_array_to_buffer(VecArraySoA(output), n_elem,2, buffer);});
         }
     }
 
     virtual void compute_value(ComputeMode mode) {
         Timer timer(string("rama_coord"));
 
-        VecArray rama_pos = output;
+        VecArraySoA rama_pos(output);
         float*   posv     = pos.output.x.get();
 
         for(int nt=0; nt<n_elem; ++nt) {
@@ -229,10 +232,11 @@ struct RamaCoord : public CoordNode
     virtual void propagate_deriv() {
         Timer timer(string("rama_coord_deriv"));
         float* pos_sens = pos.sens.x.get();
+        VecArraySoA rama_sens(sens);
 
         for(int nt=0; nt<n_elem; ++nt) {
             const auto& p = params[nt];
-            Float4 s[2] = {Float4(sens(0,nt)), Float4(sens(1,nt))};
+            Float4 s[2] = {Float4(rama_sens(0,nt)), Float4(rama_sens(1,nt))};
 
             Float4 ps[5];
             for(int na: range(5))
@@ -299,7 +303,7 @@ struct DistSpring : public PotentialNode
 
         VecArray posc = pos.output;
         VecArray pos_sens = pos.sens;
-        float* pot = mode==PotentialAndDerivMode ? &potential : nullptr;
+        float* pot = potential_needed(mode) ? &potential : nullptr;
         if(pot) *pot = 0.f;
 
         for(int nt=0; nt<n_elem; ++nt) {
@@ -352,7 +356,7 @@ struct CavityRadial : public PotentialNode
 
         VecArray posc = pos.output;
         VecArray pos_sens = pos.sens;
-        float* pot = mode==PotentialAndDerivMode ? &potential : nullptr;
+        float* pot = potential_needed(mode) ? &potential : nullptr;
         if(pot) *pot = 0.f;
 
         for(int nt=0; nt<n_term; ++nt) {
@@ -409,7 +413,7 @@ struct ZFlatBottom : public PotentialNode
 
         VecArray posc = pos.output;
         VecArray pos_sens = pos.sens;
-        float* pot = mode==PotentialAndDerivMode ? &potential : nullptr;
+        float* pot = potential_needed(mode) ? &potential : nullptr;
         if(pot) *pot = 0.f;
 
         for(int nt=0; nt<n_term; ++nt) {
@@ -461,7 +465,7 @@ struct SphericalWell : public PotentialNode
 
         VecArray posc = pos.output;
         VecArray pos_sens = pos.sens;
-        float* pot = mode==PotentialAndDerivMode ? &potential : nullptr;
+        float* pot = potential_needed(mode) ? &potential : nullptr;
         if(pot) *pot = 0.f;
 
         for(int nt=0; nt<n_term; ++nt) {
@@ -515,7 +519,7 @@ struct AngleSpring : public PotentialNode
 
         float* posc = pos.output.x.get();
         float* pos_sens = pos.sens.x.get();
-        float* pot = mode==PotentialAndDerivMode ? &potential : nullptr;
+        float* pot = potential_needed(mode) ? &potential : nullptr;
         if(pot) *pot = 0.f;
 
         for(int nt=0; nt<n_elem; ++nt) {
@@ -577,7 +581,7 @@ struct DihedralSpring : public PotentialNode
 
         float* posc = pos.output.x.get();
         float* pos_sens = pos.sens.x.get();
-        float* pot = mode==PotentialAndDerivMode ? &potential : nullptr;
+        float* pot = potential_needed(mode) ? &potential : nullptr;
         if(pot) *pot = 0.f;
 
         for(int nt=0; nt<n_elem; ++nt) {
@@ -3,6 +3,7 @@
 #include <map>
 #include <algorithm>
 #include <memory>
+#include <cstring>
 
 using namespace h5;
 
@@ -85,6 +86,13 @@ void check_elem_width(const CoordNode& node, int expected_elem_width) {
             " but received argument with width " + std::to_string(node.elem_width);
 }
 
+void check_layout(const CoordNode& node, Layout expected_layout) {
+    ++node.n_layout_checks;
+    if(node.elem_width>1 && node.output.layout() != expected_layout)
+        throw std::string("expected argument with ") + (expected_layout==Layout::SoA ? "SoA" : "AoS") +
+            " layout but received argument with the other layout";
+}
+
 void check_arguments_length(const ArgList& arguments, int n_expected) {
     if(int(arguments.size()) != n_expected) 
         throw std::string("expected ") + std::to_string(n_expected) + 
@@ -101,6 +109,7 @@ void DerivEngine::add_node(
 
     nodes.emplace_back(name, move(fcn));
     auto& node = nodes.back();
+    schedule_valid = false;
 
     for(auto& nm: argument_names) { 
         int parent_idx = get_idx(nm);
@@ -121,50 +130,315 @@ int DerivEngine::get_idx(const string& name, bool must_exist) {
     return loc != nodes.end() ? loc-begin(nodes) : -1;
 }
 
-void DerivEngine::compute(ComputeMode mode) {
-    // FIXME depth-first traversal would be simpler and more cache-friendly
-    for(auto& n: nodes) n.germ_exec_level = n.deriv_exec_level = -1;
+// Elements are processed in blocks that stay in L1 cache while passing through a FusedChain
+static const int fused_block_size = 64;
+static const int max_fused_links  = 4;
+
+void DerivEngine::find_fused_chains() {
+    fused_chains.clear();
+    fused_role.assign(nodes.size(), -1);
+    if(!fuse_elementwise) return;
+
+    auto elementwise_parent = [&](int i) {
+        auto& n = nodes[i];
+        return n.parents.size()==1u &&
+            n.computation->elementwise_input() == nodes[n.parents[0]].computation.get();
+    };
+
+    for(int i: range(nodes.size())) {
+        if(!nodes[i].computation->potential_term || !elementwise_parent(i)) continue;
+
+        // Absorb ancestors that are elementwise and whose only consumer is the chain
+        FusedChain chain;
+        chain.consumer = i;
+        int curr = nodes[i].parents[0];
+        while(int(chain.links.size())<max_fused_links && curr!=0 && fused_role[curr]==-1 &&
+                nodes[curr].children.size()==1u && elementwise_parent(curr)) {
+            chain.links.push_back(curr);
+            curr = nodes[curr].parents[0];
+        }
+        if(chain.links.empty()) continue;
+        reverse(begin(chain.links), end(chain.links));
+        chain.root = curr;
 
-    if(mode == PotentialAndDerivMode) potential = 0.f;
+        for(int nl: chain.links) fused_role[nl] = -2;
+        fused_role[i] = fused_chains.size();
+        fused_chains.push_back(chain);
+    }
+}
+
+
+void DerivEngine::build_exec_schedule() {
+    find_fused_chains();
+    for(auto& n: nodes) n.germ_exec_level = n.deriv_exec_level = -1;
 
-    // BFS traversal
-    for(int lvl=0, not_finished=1; ; ++lvl, not_finished=0) {
+    // BFS level assignment; a node executes one level after the last of its parents
+    // (or children for the derivative), so the graph must be acyclic
+    for(int lvl=0, not_finished=1; not_finished; ++lvl) {
+        not_finished = 0;
         for(auto& n: nodes) {
             if(n.germ_exec_level == -1) {
                 not_finished = 1;
-                bool all_parents = all_of(begin(n.parents), end(n.parents), [&] (int ip) {
+                if(all_of(begin(n.parents), end(n.parents), [&] (int ip) {
                         int exec_lvl = nodes[ip].germ_exec_level;
-                        return exec_lvl!=-1 && exec_lvl!=lvl; // do not execute at same level as your parents
-                        });
-
-                if(all_parents) {
-                    n.computation->compute_value(mode);
+                        return exec_lvl!=-1 && exec_lvl!=lvl;}))
                     n.germ_exec_level = lvl;
-                    if(mode == PotentialAndDerivMode && n.computation->potential_term) {
-                        auto pot_node = static_cast<PotentialNode*>(n.computation.get());
-                        potential += pot_node->potential;
-                    }
-                    if(!n.computation->potential_term) {
-                        // ensure zero sensitivity for later derivative writing
-                        CoordNode* coord_node = static_cast<CoordNode*>(n.computation.get());
-                        fill(coord_node->sens, 0.f);
-                    }
-                }
             }
-
-            if(n.deriv_exec_level == -1 && n.germ_exec_level != -1) {
+            if(n.deriv_exec_level == -1) {
                 not_finished = 1;
-                bool all_children = all_of(begin(n.children), end(n.children), [&] (int ip) {
+                if(all_of(begin(n.children), end(n.children), [&] (int ip) {
                         int exec_lvl = nodes[ip].deriv_exec_level;
-                        return exec_lvl!=-1 && exec_lvl!=lvl; // do not execute at same level as your children
-                        });
-                if(all_children) {
-                    n.computation->propagate_deriv();
+                        return exec_lvl!=-1 && exec_lvl!=lvl;}))
                     n.deriv_exec_level = lvl;
-                }
             }
         }
-        if(!not_finished) break;
+    }
+
+    vector<int> germ_order(nodes.size()), deriv_order(nodes.size());
+    for(int i: range(nodes.size())) germ_order[i] = deriv_order[i] = i;
+    stable_sort(begin(germ_order),  end(germ_order),  [&](int i, int j) {
+            return nodes[i].germ_exec_level  < nodes[j].germ_exec_level;});
+    stable_sort(begin(deriv_order), end(deriv_order), [&](int i, int j) {
+            return nodes[i].deriv_exec_level < nodes[j].deriv_exec_level;});
+
+    germ_schedule.clear();
+    deriv_schedule.clear();
+    sens_to_zero.clear();
+
+    germ_schedule = germ_order;
+
+    for(int i: deriv_order) {
+        auto& n = nodes[i];
+        if(n.computation->potential_term) continue;
+        if(fused_role[i]==-2) continue;  // sens of fused links is never written
+        auto coord_node = static_cast<CoordNode*>(n.computation.get());
+
+        // Nothing is ever written to the sensitivity of a childless node, so zero
+        // it once here in case someone reads it.  Pos is always zeroed since its
+        // sensitivity is the output of the engine.
+        if(n.children.empty() && i!=0) {
+            fill(coord_node->sens, 0.f);
+            continue;
+        }
+        deriv_schedule.push_back(coord_node);
+        sens_to_zero  .push_back(coord_node);
+    }
+
+    // Task graph for the parallel executor.  Task i<n_node is compute_value of node i and task
+    // n_node+i is propagate_deriv of node i (only present for nodes in deriv_schedule).
+    int n_node = nodes.size();
+    vector<int> has_deriv_task(n_node, 0);
+    for(int i: range(n_node))
+        has_deriv_task[i] = find(begin(deriv_schedule), end(deriv_schedule),
+                nodes[i].computation.get()) != end(deriv_schedule);
+
+    exec_tasks.clear();
+    exec_tasks.resize(2*n_node);
+    for(int i: range(n_node)) {
+        exec_tasks[i]       .computation = nodes[i].computation.get();
+        exec_tasks[n_node+i].computation = has_deriv_task[i] ? nodes[i].computation.get() : nullptr;
+        exec_tasks[i]       .is_deriv = false;
+        exec_tasks[n_node+i].is_deriv = true;
+    }
+    auto add_dep = [&](int before, int after) {
+        auto& succ = exec_tasks[before].successors;
+        if(find(begin(succ), end(succ), after) != end(succ)) return;
+        succ.push_back(after);
+        exec_tasks[after].n_predecessor++;
+    };
+
+    for(int i: range(n_node)) {
+        for(int ip: nodes[i].parents) add_dep(ip, i);
+        if(has_deriv_task[i]) add_dep(i, n_node+i);
+    }
+
+    // Writers of sens for node i are potential children and consumers of chains rooted at i
+    // (during compute_value) followed by children in deriv_schedule (during propagate_deriv),
+    // each in serial execution order
+    for(int i: range(n_node)) {
+        if(!has_deriv_task[i]) continue;
+        vector<int> writers;
+        for(int ig: germ_order)
+            if(nodes[ig].computation->potential_term && (
+                    find(begin(nodes[i].children), end(nodes[i].children), size_t(ig)) != end(nodes[i].children) ||
+                    (fused_role[ig]>=0 && fused_chains[fused_role[ig]].root==i)))
+                writers.push_back(ig);
+        for(int id: deriv_order)
+            if(has_deriv_task[id] &&
+                    find(begin(nodes[i].children), end(nodes[i].children), size_t(id)) != end(nodes[i].children))
+                writers.push_back(n_node+id);
+
+        for(int nw=1; nw<int(writers.size()); ++nw) add_dep(writers[nw-1], writers[nw]);
+        for(int w: writers) add_dep(w, n_node+i);
+    }
+    exec_pending.assign(exec_tasks.size(), 0);
+    node_stale  .assign(n_node, 1);
+
+    schedule_valid = true;
+}
+
+
+void DerivEngine::set_n_threads(int n_threads_) {
+    n_threads = n_threads_;
+    for(auto& n: nodes) n.computation->set_n_threads(n_threads);
+}
+
+
+void DerivEngine::jit_specialize(const string& cache_dir) {
+    for(auto& n: nodes) n.computation->jit_specialize(cache_dir);
+}
+
+
+void DerivEngine::set_fuse_elementwise(bool fuse) {
+    fuse_elementwise = fuse;
+    schedule_valid = false;
+    invalidate();
+}
+
+
+void DerivEngine::invalidate() {
+    for(auto& n: nodes) n.computed_mode = -1;
+    pos_snapshot.clear();
+}
+
+
+void DerivEngine::execute_node(int i, ComputeMode mode) {
+    int role = fused_role[i];
+    if(role==-1)     nodes[i].computation->compute_value(mode);
+    else if(role>=0) compute_fused(fused_chains[role], mode);
+    // links are executed by the consumer of their chain
+}
+
+
+void DerivEngine::compute_fused(const FusedChain& chain, ComputeMode mode) {
+    Timer timer(string("fused_chain"));
+    auto root     = static_cast<CoordNode*>    (nodes[chain.root]    .computation.get());
+    auto consumer = static_cast<PotentialNode*>(nodes[chain.consumer].computation.get());
+
+    int n_link = chain.links.size();
+    CoordNode* links[max_fused_links];
+    for(int nl: range(n_link)) links[nl] = static_cast<CoordNode*>(nodes[chain.links[nl]].computation.get());
+
+    // x[nl] is the input to link nl, and x[n_link] is the input to the consumer
+    float x    [max_fused_links+1][fused_block_size];
+    float dy_dx[max_fused_links  ][fused_block_size];
+    float grad [fused_block_size];
+
+    float pot = 0.f;
+    int n_elem = links[0]->n_elem;
+    for(int start=0; start<n_elem; start+=fused_block_size) {
+        int n = min(fused_block_size, n_elem-start);
+        for(int ne: range(n)) x[0][ne] = root->output(0,start+ne);
+
+        for(int nl: range(n_link)) {
+            links[nl]->transform_block(start, n, x[nl], x[nl+1], dy_dx[nl]);
+            for(int ne: range(n)) links[nl]->output(0,start+ne) = x[nl+1][ne];
+        }
+        consumer->reduce_block(start, n, x[n_link], pot, grad);
+
+        if(deriv_needed(mode)) {
+            for(int nl=n_link-1; nl>=0; --nl)
+                for(int ne: range(n)) grad[ne] = dy_dx[nl][ne]*grad[ne];
+            for(int ne: range(n)) root->sens(0,start+ne) += grad[ne];
+        }
+    }
+    consumer->potential = pot;
+}
+
+
+void DerivEngine::run_exec_task(int task_idx, ComputeMode mode) {
+    auto& task = exec_tasks[task_idx];
+    if(task.is_deriv) {
+        if(deriv_needed(mode)) task.computation->propagate_deriv();
+    }
+    else if(task.computation->potential_term || node_stale[task_idx])
+        execute_node(task_idx, mode);
+
+    for(int succ: task.successors) {
+        int remaining;
+        #pragma omp atomic capture
+        remaining = --exec_pending[succ];
+        if(!remaining) {
+            #pragma omp task firstprivate(succ)
+            run_exec_task(succ, mode);
+        }
+    }
+}
+
+
+void DerivEngine::compute(ComputeMode mode) {
+    if(!schedule_valid) build_exec_schedule();
+
+    // Detect modification of the positions since the last call
+    {
+        const float* x = pos->output.x.get();
+        size_t n_float = size_t(pos->output.n_elem)*pos->output.row_width;
+        if(pos_snapshot.size()!=n_float || memcmp(pos_snapshot.data(), x, n_float*sizeof(float))) {
+            pos_snapshot.assign(x, x+n_float);
+            nodes[0].output_version = ++version_clock;
+        }
+    }
+
+    // Nodes are stored in topological order, so staleness can be propagated in a single pass
+    bool any_stale = false;
+    node_stale[0] = 0;
+    for(int i: range(1,nodes.size())) {
+        auto& n = nodes[i];
+        bool stale = !mode_covers(n.computed_mode, mode) || !n.computation->memoizable();
+        for(int ip: n.parents)
+            stale |= node_stale[ip] || nodes[ip].output_version > n.output_version;
+        node_stale[i] = stale;
+        any_stale |= stale;
+    }
+    if(!any_stale) return;
+
+    // node outputs may change, so shared pairlist caches must be checked again
+    if(pairlists) ++pairlists->epoch;
+
+    if(potential_needed(mode)) potential = 0.f;
+
+    // ensure zero sensitivity for later derivative writing
+    if(deriv_needed(mode))
+        for(auto coord_node: sens_to_zero) fill(coord_node->sens, 0.f);
+
+    if(n_threads>1) {
+        // Nodes whose inputs are ready are dispatched as OpenMP tasks.  Potential nodes are
+        // summed afterward in schedule order so that the potential is deterministic.
+        for(int nt: range(exec_tasks.size())) exec_pending[nt] = exec_tasks[nt].n_predecessor;
+
+        #pragma omp parallel num_threads(n_threads)
+        #pragma omp single
+        {
+            for(int nt: range(exec_tasks.size())) {
+                if(exec_tasks[nt].n_predecessor || !exec_tasks[nt].computation) continue;
+                #pragma omp task firstprivate(nt)
+                run_exec_task(nt, mode);
+            }
+        }
+
+        if(potential_needed(mode))
+            for(int i: germ_schedule)
+                if(nodes[i].computation->potential_term)
+                    potential += static_cast<PotentialNode*>(nodes[i].computation.get())->potential;
+    } else {
+        for(int i: germ_schedule) {
+            auto comp = nodes[i].computation.get();
+            if(comp->potential_term || node_stale[i]) execute_node(i, mode);
+            if(potential_needed(mode) && comp->potential_term)
+                potential += static_cast<PotentialNode*>(comp)->potential;
+        }
+
+        if(deriv_needed(mode))
+            for(auto coord_node: deriv_schedule)
+                coord_node->propagate_deriv();
+    }
+
+    for(int i: range(1,nodes.size())) {
+        auto& n = nodes[i];
+        if(n.computation->potential_term || node_stale[i]) {
+            n.computed_mode  = mode;
+            n.output_version = ++version_clock;
+        }
     }
 }
 
@@ -227,6 +501,9 @@ DerivEngine initialize_engine_from_hdf5(int n_atom, hid_t potential_group, bool
     for(auto &kv : dep_graph) if(kv.second.first) 
         throw string("Unsatisfiable dependency ") + kv.first + " in potential computation";
 
+    engine.pairlists = std::make_shared<PairlistRegistry>();
+    PairlistRegistryScope pairlist_scope(engine.pairlists.get());
+
     // using topo_order here ensures that a node is only parsed after all its arguments
     for(auto &nm : topo_order) {
         // if(!quiet)  printf("initializing %-27s%s", nm.c_str(), nm=="pos" ? "\n" : ""); 
@@ -259,13 +536,25 @@ DerivEngine initialize_engine_from_hdf5(int n_atom, hid_t potential_group, bool
 
         try {
             auto grp = open_group(potential_group,nm.c_str());
+            vector<int> n_layout_checks;
+            for(auto arg: arguments) n_layout_checks.push_back(arg->n_layout_checks);
+
             auto computation = unique_ptr<DerivComputation>(node_func(grp.get(),arguments));
+
+            // Viewing SoA storage as a VecArray throws, so a consumer that does not check the
+            // layout of its SoA arguments is rejected here rather than in the middle of a run
+            for(int na: range(arguments.size()))
+                if(arguments[na]->output.layout()==Layout::SoA && arguments[na]->n_layout_checks==n_layout_checks[na])
+                    throw "argument " + argument_names[na] + " has the SoA layout, which the node does not " +
+                        "accept (see check_layout)";
+
             engine.add_node(nm, move(computation), argument_names);
         } catch(const string &e) {
             throw "while adding '" + nm + "', " + e;
         }
     }
 
+    engine.build_exec_schedule();
     return engine;
 }
 
@@ -7,10 +7,13 @@
 #include <functional>
 #include <initializer_list>
 #include <map>
+#include <memory>
+#include <cstdint>
 #include "vector_math.h"
 
 //!\brief Copy VecArray to a flat float* array
-inline void copy_vec_array_to_buffer(VecArray arr, int n_elem, int n_dim, float* buffer) {
+template <typename VArray>
+inline void copy_vec_array_to_buffer(const VArray& arr, int n_elem, int n_dim, float* buffer) {
         for(int i=0; i<n_elem; ++i)
             for(int d=0; d<n_dim; ++d) 
                 buffer[i*n_dim+d] = arr(d,i);
@@ -41,9 +44,18 @@ recenter(
 //! \brief Whether to compute potential value as well as its derivative
 enum ComputeMode {
     DerivMode = 0, //!< Only derivative must be computed correctly (potential may not be correct)
-    PotentialAndDerivMode = 1 //!< Compute potential and derivative correctly
+    PotentialAndDerivMode = 1, //!< Compute potential and derivative correctly
+    PotentialOnlyMode = 2 //!< Only potential must be computed correctly (sensitivities may be any value)
 };
 
+//! \brief True if the potential must be computed correctly in this mode
+inline bool potential_needed(ComputeMode mode) {return mode != DerivMode;}
+
+//! \brief True if the derivative must be computed correctly in this mode
+inline bool deriv_needed(ComputeMode mode) {return mode != PotentialOnlyMode;}
+
+struct CoordNode;
+
 //! \brief Differentiable computation node
 struct DerivComputation 
 {
@@ -68,6 +80,32 @@ struct DerivComputation
 
     //! \brief Set arbitrary subset of parameters (same as get_param)
     virtual void set_param(const std::vector<float>& new_params) {}
+
+    //! \brief True if compute_value depends only on the inputs and parameters of the node
+    //!
+    //! DerivEngine skips compute_value for memoizable CoordNode's whose inputs have not
+    //! changed.  Nodes whose value changes from call to call (e.g. time-dependent
+    //! potentials) must return false.
+    virtual bool memoizable() const {return true;}
+
+    //! \brief Allow the computation to split its work into n_threads OpenMP tasks
+    //!
+    //! Computations without internal parallelism may ignore this.
+    virtual void set_n_threads(int n_threads) {}
+
+    //! \brief Input of an elementwise node, or nullptr if the node is not elementwise
+    //!
+    //! An elementwise node has a single width-1 input, and each element of its result depends
+    //! only on the same element of the input.  Such a CoordNode must implement transform_block
+    //! and such a PotentialNode must implement reduce_block, so that chains of them can be
+    //! fused into a single loop (see DerivEngine::FusedChain).
+    virtual CoordNode* elementwise_input() {return nullptr;}
+
+    //! \brief Replace inner loops with kernels compiled for the loaded parameters
+    //!
+    //! Generated code is cached in cache_dir (see jit_load_symbol).  Computations without
+    //! specialized kernels may ignore this.
+    virtual void jit_specialize(const std::string& cache_dir) {}
 #ifdef PARAM_DERIV
     //! \brief Param deriv of arbitrary subset of parameters (same as get_param)
     virtual std::vector<float> get_param_deriv() {return std::vector<float>();}
@@ -86,13 +124,26 @@ struct CoordNode : public DerivComputation
     int elem_width;  //!< number of dimensions for each output element
     VecArrayStorage output; //!< output values
     VecArrayStorage sens; //!< sensitivity of the overall potential to each output value
+    mutable int n_layout_checks; //!< number of calls to check_layout on this node
 
-    //! Initialize from n_elem and elem_width
-    CoordNode(int n_elem_, int elem_width_):
+    //! \brief Initialize from n_elem and elem_width
+    //!
+    //! Nodes whose consumers may read output and sens through raw pointers (such as pos)
+    //! must use the default AoS layout.  A consumer of a node in the SoA layout must call
+    //! check_layout on it, or initialize_engine_from_hdf5 rejects the graph.
+    CoordNode(int n_elem_, int elem_width_, Layout layout=Layout::AoS):
         DerivComputation(false),
         n_elem(n_elem_), elem_width(elem_width_), 
-        output(elem_width, round_up(n_elem,4)),
-        sens  (elem_width, round_up(n_elem,4)) {}
+        output(elem_width, round_up(n_elem,4), layout),
+        sens  (elem_width, round_up(n_elem,4), layout),
+        n_layout_checks(0) {}
+
+    //! \brief Elementwise value and derivative for the n elements beginning at start
+    //!
+    //! Only called if elementwise_input is non-null.  x holds the input value for each element,
+    //! and y and dy_dx receive the output value and its derivative with respect to x.  This
+    //! must not read or write output or sens.
+    virtual void transform_block(int start, int n, const float* x, float* y, float* dy_dx) {}
 };
 
 
@@ -107,6 +158,13 @@ struct PotentialNode : public DerivComputation
     //!
     //! The propagate_deriv function is never called for potential nodes
     virtual void propagate_deriv() {};
+
+    //! \brief Add the potential for the n elements beginning at start to pot
+    //!
+    //! Only called if elementwise_input is non-null.  x holds the input value for each element,
+    //! and dpot_dx receives the derivative of the potential with respect to x.  Elements must be
+    //! added to pot in order so that the result matches compute_value.
+    virtual void reduce_block(int start, int n, const float* x, float& pot, float* dpot_dx) {}
 };
 
 
@@ -141,6 +199,37 @@ struct Pos : public CoordNode
 };
 
 
+//! \brief Pairlist caches shared by the nodes of an engine (see PairlistCache)
+//!
+//! The registry only holds weak references, so a cache is freed with its last pairlist.
+struct PairlistRegistry {
+    //! \brief Incremented at each compute, so that a shared cache is checked once per compute
+    uint64_t epoch;
+    //! \brief Caches by a key describing their inputs (see pairlist_cache_key)
+    std::map<std::vector<int64_t>, std::weak_ptr<void>> caches;
+
+    PairlistRegistry(): epoch(0u) {}
+};
+
+//! \brief Registry used by pairlists constructed on the current thread (nullptr for no sharing)
+//!
+//! Nodes are constructed without a reference to their engine, so initialize_engine_from_hdf5
+//! makes the registry of the engine under construction available here.
+inline PairlistRegistry*& current_pairlist_registry() {
+    static thread_local PairlistRegistry* registry = nullptr;
+    return registry;
+}
+
+//! \brief Set current_pairlist_registry for the lifetime of the scope
+struct PairlistRegistryScope {
+    PairlistRegistry* previous;
+    PairlistRegistryScope(PairlistRegistry* registry): previous(current_pairlist_registry()) {
+        current_pairlist_registry() = registry;
+    }
+    ~PairlistRegistryScope() {current_pairlist_registry() = previous;}
+};
+
+
 //! Main class to represent differentiable computational graph
 struct DerivEngine
 {
@@ -155,12 +244,15 @@ struct DerivEngine
         int germ_exec_level; //!< Directed acyclic graph height of compute_value computation
         int deriv_exec_level;//!< Directed acyclic graph height of propagate_deriv computation
 
+        uint64_t output_version; //!< DerivEngine::version_clock value when the output last changed
+        int computed_mode;       //!< ComputeMode of the last compute_value call (-1 if output is invalid)
+
         //! \brief Construct from name and unique_ptr to computation
         Node(std::string name_, std::unique_ptr<DerivComputation> computation_):
-            name(name_), computation(std::move(computation_)) {};
+            name(name_), computation(std::move(computation_)), output_version(0u), computed_mode(-1) {};
         //! \brief Construct from name and raw pointer to computation
         Node(std::string name_, DerivComputation* computation_):
-            name(name_), computation(computation_) {};
+            name(name_), computation(computation_), output_version(0u), computed_mode(-1) {};
         Node(const Node& other) = delete;
         //! \brief Move constructor (Node's are not copyable)
         Node(Node&& other):
@@ -169,7 +261,9 @@ struct DerivEngine
             parents(std::move(other.parents)),
             children(std::move(other.children)),
             germ_exec_level(other.germ_exec_level),
-            deriv_exec_level(other.deriv_exec_level)
+            deriv_exec_level(other.deriv_exec_level),
+            output_version(other.output_version),
+            computed_mode(other.computed_mode)
         {}
     };
 
@@ -181,15 +275,88 @@ struct DerivEngine
     Pos* pos;
     //! \brief potential energy output of the computation graph
     //!
-    //! The potential should only be read after calling compute(PotentialAndDerivMode)
-    //! and may be any value after the completion of compute(DerivMode)
+    //! The potential should only be read after calling compute(PotentialAndDerivMode) or
+    //! compute(PotentialOnlyMode) and may be any value after the completion of compute(DerivMode)
     float potential;
 
+    //! \brief True if the execution schedule below reflects the current graph
+    bool schedule_valid;
+    //! \brief Indices of nodes in the order that compute_value is called (increasing germ_exec_level)
+    std::vector<int> germ_schedule;
+    //! \brief Nodes in the order that propagate_deriv is called (increasing deriv_exec_level)
+    //!
+    //! Potential nodes and CoordNode's without children are omitted since they have
+    //! no sensitivity to propagate.
+    std::vector<CoordNode*> deriv_schedule;
+    //! \brief CoordNode's whose sensitivity must be zeroed before each compute
+    std::vector<CoordNode*> sens_to_zero;
+
+    //! \brief Number of threads used to execute independent nodes concurrently
+    //!
+    //! When n_threads is 1, nodes are executed serially in schedule order.  An exception
+    //! thrown by a node inside the parallel executor terminates the program.
+    int n_threads;
+
+    //! \brief A compute_value or propagate_deriv call in the parallel executor
+    struct ExecTask {
+        DerivComputation* computation; //!< node to execute
+        bool is_deriv;                 //!< true for propagate_deriv, false for compute_value
+        int n_predecessor;             //!< number of tasks that must finish before this one
+        std::vector<int> successors;   //!< tasks that are waiting on this one
+    };
+    //! \brief Task graph for the parallel executor
+    //!
+    //! Besides the data dependencies of the graph, all writers of a given sens array are
+    //! chained in the order of the serial schedule.  This avoids data races and makes the
+    //! parallel result bitwise identical to the serial result.
+    std::vector<ExecTask> exec_tasks;
+    //! \brief Remaining predecessor count for each task during execution
+    std::vector<int> exec_pending;
+
+    //! \brief Chain of elementwise nodes evaluated as a single loop over elements
+    //!
+    //! The output of root passes through each of links in turn and is summed by consumer,
+    //! one block of elements at a time, so no intermediate array is read back.  The outputs
+    //! of the links are still written for loggers, but their sens is not computed.
+    struct FusedChain {
+        int root;               //!< node providing the input to the chain (not fused)
+        std::vector<int> links; //!< elementwise CoordNode's, each the only child of the previous
+        int consumer;           //!< elementwise PotentialNode that executes the chain
+    };
+    //! \brief Whether build_exec_schedule fuses chains of elementwise nodes
+    bool fuse_elementwise;
+    //! \brief Chains found by build_exec_schedule
+    std::vector<FusedChain> fused_chains;
+    //! \brief For each node, its index in fused_chains if it is a consumer, -2 if it is a link, else -1
+    std::vector<int> fused_role;
+
+    //! \brief True if a node evaluated in computed_mode has all the results required by mode
+    static bool mode_covers(int computed_mode, ComputeMode mode) {
+        return computed_mode == int(mode) || computed_mode == int(PotentialAndDerivMode);
+    }
+
+    //! \brief Monotonic counter used to stamp Node::output_version
+    uint64_t version_clock;
+    //! \brief Copy of the positions at the last compute, used to detect changes to pos->output
+    std::vector<float> pos_snapshot;
+    //! \brief For each node, whether compute_value must be called in the current compute
+    //!
+    //! Potential nodes are always executed when any node is stale, since they write
+    //! the sensitivities of their inputs during compute_value.
+    std::vector<int> node_stale;
+
+    //! \brief Pairlist caches shared by the nodes (null if nodes were not constructed by initialize_engine_from_hdf5)
+    std::shared_ptr<PairlistRegistry> pairlists;
+
     //! \brief Default constructor (not used)
-    DerivEngine() {}
+    DerivEngine(): schedule_valid(false), n_threads(1), fuse_elementwise(true), version_clock(0u) {}
     //! \brief Construct from number of atoms
     DerivEngine(int n_atom): 
-        potential(0.f)
+        potential(0.f),
+        schedule_valid(false),
+        n_threads(1),
+        fuse_elementwise(true),
+        version_clock(0u)
     {
         nodes.emplace_back("pos", new Pos(n_atom));
         pos = dynamic_cast<Pos*>(nodes[0].computation.get());
@@ -221,11 +388,50 @@ struct DerivEngine
         return dynamic_cast<T&>(*computation);
     }
 
+    //! \brief Freeze the execution order of the graph
+    //!
+    //! Assigns germ_exec_level and deriv_exec_level to each node and flattens them into
+    //! germ_schedule and deriv_schedule.  This is called by initialize_engine_from_hdf5 and
+    //! lazily by compute if nodes have been added since the last call.
+    void build_exec_schedule();
+
+    //! \brief Set n_threads for the engine and all of its nodes
+    void set_n_threads(int n_threads_);
+
+    //! \brief Call jit_specialize on all nodes
+    void jit_specialize(const std::string& cache_dir);
+
+    //! \brief Enable or disable fusion of elementwise chains
+    //!
+    //! Fusion must be disabled if the sens of intermediate nodes is needed.
+    void set_fuse_elementwise(bool fuse);
+
+    //! \brief Fill fused_chains and fused_role (called by build_exec_schedule)
+    void find_fused_chains();
+
+    //! \brief Force all nodes to be recomputed on the next call to compute
+    //!
+    //! Must be called after modifying a node other than through pos->output, such as
+    //! with set_param.
+    void invalidate();
+
     //! \brief Execute computational graph
     //!
-    //! See ComputeMode for details.
+    //! See ComputeMode for details.  Changes to pos->output are detected automatically,
+    //! and CoordNode's whose inputs are unchanged since their last evaluation are not
+    //! recomputed.  If nothing has changed, the outputs, sensitivities, and potential of
+    //! the previous call are left in place.
     void compute(ComputeMode mode);
 
+    //! \brief Call compute_value for node i, or run its chain if it is a fused consumer
+    void execute_node(int i, ComputeMode mode);
+
+    //! \brief Execute a FusedChain
+    void compute_fused(const FusedChain& chain, ComputeMode mode);
+
+    //! \brief Execute a task of exec_tasks and dispatch any successors that become ready
+    void run_exec_task(int task_idx, ComputeMode mode);
+
     //! \brief Integration scheme (i.e. position and velocity update weights) to use
     enum IntegratorType {Verlet=0, Predescu=1};
 
@@ -269,6 +475,12 @@ void check_elem_width(const CoordNode& node, int expected_elem_width);
 //! \brief Throw exception if elem_width of node is not at least elem_width_lower_bound
 void check_elem_width_lower_bound(const CoordNode& node, int elem_width_lower_bound);
 
+//! \brief Throw exception if the output of a node of width greater than 1 is not in expected_layout
+//!
+//! Every consumer of a node in the SoA layout must call this on it in its constructor, since
+//! viewing SoA storage as a VecArray throws (see initialize_engine_from_hdf5).
+void check_layout(const CoordNode& node, Layout expected_layout);
+
 //! \brief Throw except if ArgList is not length n_expected
 void check_arguments_length(const ArgList& arguments, int n_expected);
 
@@ -284,8 +284,8 @@ struct AffineAlignment : public CoordNode
     int n_group;
     CoordNode& pos;
     vector<Params> params;
-    unique_ptr<Float4[]> evals_storage;
-    unique_ptr<Float4[]> evecs_storage;
+    aligned_array<Float4> evals_storage;
+    aligned_array<Float4> evecs_storage;
 
     AffineAlignment(hid_t grp, CoordNode& pos_):
         CoordNode(get_dset_size(2, grp, "atoms")[0], 7),
@@ -11,6 +11,7 @@ DerivEngine* construct_deriv_engine(int n_atom, const char* potential_file, bool
     auto potential_group = open_group(config.get(), "/input/potential");
     
     auto engine = new DerivEngine(initialize_engine_from_hdf5(n_atom, potential_group.get(), quiet));
+    engine->set_fuse_elementwise(false);  // get_sens must be valid for every node
     return engine;
 } catch(const string& e) {
     fprintf(stderr, "\n\nERROR: %s\n", e.c_str());
@@ -44,6 +45,26 @@ int evaluate_energy(float* energy, DerivEngine* engine, const float* pos) try {
     return 1;
 }
 
+// Same as evaluate_energy, but the sensitivities and parameter derivatives are not computed,
+// so get_sens is not valid afterward.  0 indicates success, anything else is failure
+int evaluate_energy_only(float* energy, DerivEngine* engine, const float* pos) try {
+    VecArray a = engine->pos->output;
+    for(int na: range(engine->pos->n_atom))
+        for(int d: range(3))
+            a(d,na) = pos[na*3+d];
+    engine->compute(PotentialOnlyMode);
+    *energy = engine->potential;
+    return 0;
+} catch(const char* e) {
+    fprintf(stderr, "\n\nERROR: %s\n", e);
+    return 1;
+} catch(const string& e) {
+    fprintf(stderr, "\n\nERROR: %s\n", e.c_str());
+    return 1;
+} catch(...) {
+    return 1;
+}
+
 // 0 indicates success, anything else is failure
 int evaluate_deriv(float* deriv, DerivEngine* engine, const float* pos) try {
     // result is size (n_atom,3)
@@ -67,6 +88,7 @@ int evaluate_deriv(float* deriv, DerivEngine* engine, const float* pos) try {
 int set_param(int n_param, const float* param, DerivEngine* engine, const char* node_name) try {
     vector<float> param_v(param, param+n_param);
     engine->get(string(node_name)).computation->set_param(param_v);
+    engine->invalidate();
     return 0;
 } catch(const string& s) {
     fprintf(stderr, "ERROR: %s\n", s.c_str());
@@ -92,7 +114,11 @@ int get_param(int n_param, float* param, DerivEngine* engine, const char* node_n
 
 int get_param_deriv(int n_param, float* deriv, DerivEngine* engine, const char* node_name) try {
 #ifdef PARAM_DERIV
+    // the last evaluation may have been energy-only, and nodes that are already up to date for
+    // the current positions are not computed again
+    engine->compute(PotentialAndDerivMode);
     auto deriv_v = engine->get(string(node_name)).computation->get_param_deriv();
+    engine->invalidate();  // get_param_deriv may overwrite sensitivities
     if(deriv_v.size() != size_t(n_param)) 
         throw string("Wrong number of parameters, expected ") + to_string(deriv_v.size()) + " but got " + 
             to_string(n_param);
@@ -119,10 +145,10 @@ int get_sens(int n_output, float* sens, DerivEngine* engine, const char* node_na
     } else {
         auto& c = dynamic_cast<CoordNode&>(dc);
         if(n_output != c.n_elem*c.elem_width) throw string("wrong size for CoordNode");
-        VecArray a = c.sens;
-        for(int ne: range(c.n_elem))
-            for(int d: range(c.elem_width))
-                sens[ne*c.elem_width + d] = a(d,ne);
+        if(c.sens.layout()==Layout::SoA)
+            copy_vec_array_to_buffer(VecArraySoA(c.sens), c.n_elem, c.elem_width, sens);
+        else
+            copy_vec_array_to_buffer(VecArray   (c.sens), c.n_elem, c.elem_width, sens);
     }
     return 0;
 } catch(const string& s) {
@@ -143,10 +169,10 @@ int get_output(int n_output, float* output, DerivEngine* engine, const char* nod
     } else {
         auto& c = dynamic_cast<CoordNode&>(dc);
         if(n_output != c.n_elem*c.elem_width) throw string("wrong size for CoordNode");
-        VecArray a = c.output;
-        for(int ne: range(c.n_elem))
-            for(int d: range(c.elem_width))
-                output[ne*c.elem_width + d] = a(d,ne);
+        if(c.output.layout()==Layout::SoA)
+            copy_vec_array_to_buffer(VecArraySoA(c.output), c.n_elem, c.elem_width, output);
+        else
+            copy_vec_array_to_buffer(VecArray   (c.output), c.n_elem, c.elem_width, output);
     }
     return 0;
 } catch(const string& s) {
@@ -14,6 +14,7 @@ extern "C" {
 
     int evaluate_energy(float* energy, DerivEngine* engine, const float* pos);
     int evaluate_deriv (float* deriv,  DerivEngine* engine, const float* pos);
+    int evaluate_energy_only(float* energy, DerivEngine* engine, const float* pos);
 
     int set_param      (int n_param, const  float* param,  DerivEngine* engine, const char* node_name);
 
@@ -0,0 +1,391 @@
+// Checks of engine nodes on small synthetic configurations, run by ctest.  Each test writes its
+// configuration to <test name>.h5 in the working directory and loads it the same way upside does.
+
+#include "deriv_engine.h"
+#include "vector_math.h"
+#include "h5_support.h"
+#include <cmath>
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+#include <functional>
+#include <random>
+
+using namespace std;
+using namespace h5;
+
+namespace {
+
+void require(bool condition, const string& message) {
+    if(!condition) throw message;
+}
+
+void write_string_array_attribute(hid_t grp, const char* attr_name, const vector<string>& values) {
+    size_t maxchars = 1;
+    for(auto& s: values) maxchars = max(maxchars, s.size());
+
+    vector<char> buffer(max(size_t(1), values.size()*maxchars), '\0');  // H5Awrite rejects null buffers
+    for(size_t i=0; i<values.size(); ++i) copy(begin(values[i]), end(values[i]), &buffer[i*maxchars]);
+
+    auto attr_type = h5_obj(H5Tclose, H5Tcopy(H5T_C_S1));
+    h5_noerr(H5Tset_size(attr_type.get(), maxchars));
+    hsize_t dims[1] = {values.size()};
+    auto attr_space = h5_obj(H5Sclose, H5Screate_simple(1, dims, NULL));
+    auto attr = h5_obj(H5Aclose, H5Acreate2(grp, attr_name, attr_type.get(), attr_space.get(),
+                H5P_DEFAULT, H5P_DEFAULT));
+    h5_noerr(H5Awrite(attr.get(), attr_type.get(), buffer.data()));
+}
+
+void write_float_attribute(hid_t loc, const char* path, const char* attr_name, float value) {
+    auto attr_space = h5_obj(H5Sclose, H5Screate(H5S_SCALAR));
+    auto attr = h5_obj(H5Aclose, H5Acreate_by_name(loc, path, attr_name, H5T_NATIVE_FLOAT,
+                attr_space.get(), H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT));
+    h5_noerr(H5Awrite(attr.get(), H5T_NATIVE_FLOAT, &value));
+}
+
+template <typename T>
+void write_dset(hid_t grp, const char* name, const vector<hsize_t>& dims, const vector<T>& data) {
+    size_t n = 1;
+    for(auto d: dims) n *= d;
+    require(n == data.size(), string("wrong amount of data for ") + name);
+
+    auto space = h5_obj(H5Sclose, H5Screate_simple(dims.size(), dims.data(), NULL));
+    auto dset  = h5_obj(H5Dclose, H5Dcreate2(grp, name, select_predtype<T>(), space.get(),
+                H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT));
+    h5_noerr(H5Dwrite(dset.get(), select_predtype<T>(), H5S_ALL, H5S_ALL, H5P_DEFAULT, data.data()));
+}
+
+H5Obj add_node(hid_t potential, const char* name, const vector<string>& arguments) {
+    auto grp = ensure_group(potential, name);
+    write_string_array_attribute(grp.get(), "arguments", arguments);
+    return grp;
+}
+
+H5Obj create_config(const string& path) {
+    auto config = h5_obj(H5Fclose, H5Fcreate(path.c_str(), H5F_ACC_TRUNC, H5P_DEFAULT, H5P_DEFAULT));
+    ensure_group(ensure_group(config.get(), "input").get(), "potential");
+    return config;
+}
+
+DerivEngine load_engine(const string& path, int n_atom) {
+    auto config = h5_obj(H5Fclose, H5Fopen(path.c_str(), H5F_ACC_RDONLY, H5P_DEFAULT));
+    auto potential = open_group(config.get(), "/input/potential");
+    return initialize_engine_from_hdf5(n_atom, potential.get(), true);
+}
+
+void set_pos(DerivEngine& engine, const vector<float>& pos) {
+    VecArray a = engine.pos->output;
+    for(int na: range(engine.pos->n_atom))
+        for(int d: range(3))
+            a(d,na) = pos[na*3+d];
+}
+
+vector<float> get_pos_sens(DerivEngine& engine) {
+    vector<float> sens(engine.pos->n_atom*3);
+    VecArray a = engine.pos->sens;
+    for(int na: range(engine.pos->n_atom))
+        for(int d: range(3))
+            sens[na*3+d] = a(d,na);
+    return sens;
+}
+
+// relative RMS deviation of the derivative of the potential from central differences
+double deriv_deviation(DerivEngine& engine, vector<float> pos) {
+    vector<float> potential(1);
+    auto compute = [&]() {
+        set_pos(engine, pos);
+        engine.compute(PotentialAndDerivMode);
+        potential[0] = engine.potential;
+    };
+    auto central_diff = central_difference_deriviative(compute, pos, potential, 1e-3f);
+    compute();
+    return relative_rms_deviation(central_diff, get_pos_sens(engine));
+}
+
+
+// backbone_featurizer reads rama_coord, whose output has the SoA layout
+void test_backbone_featurizer(const string& path) {
+    int n_res  = 6;
+    int n_atom = 3*n_res;  // N, CA, C for each residue
+
+    {
+        auto config = create_config(path);
+        auto potential = open_group(config.get(), "/input/potential");
+
+        vector<int> rama_id;
+        for(int nr: range(n_res)) {
+            int n = 3*nr;
+            for(int x: {nr ? n-1 : -1, n, n+1, n+2, nr+1<n_res ? n+3 : -1}) rama_id.push_back(x);
+        }
+        write_dset(add_node(potential.get(), "rama_coord", {"pos"}).get(), "id",
+                {hsize_t(n_res),5}, rama_id);
+
+        vector<float> hbond_value;
+        for(int nr: range(n_res))
+            for(int d: range(7))
+                hbond_value.push_back(d==6 ? 0.1f*(nr+1) : 0.f);
+        write_dset(add_node(potential.get(), "constant_hbond", {}).get(), "value",
+                {hsize_t(n_res),7}, hbond_value);
+
+        vector<int> rama_idx, hbond_idx;
+        for(int nr: range(n_res)) {
+            rama_idx.push_back(nr);
+            hbond_idx.push_back(nr%3==0 ? -1 : nr);               // donor
+            hbond_idx.push_back(nr%2==0 ? -1 : (nr+2)%n_res);     // acceptor
+        }
+        auto featurizer = add_node(potential.get(), "backbone_featurizer", {"rama_coord", "constant_hbond"});
+        write_dset(featurizer.get(), "rama_idx",  {hsize_t(n_res)},   rama_idx);
+        write_dset(featurizer.get(), "hbond_idx", {hsize_t(n_res),2}, hbond_idx);
+
+        // a linear readout of the features so that their derivatives reach the positions
+        auto conv = add_node(potential.get(), "conv1d", {"backbone_featurizer"});
+        write_dset(conv.get(), "weights", {1,6,1}, vector<float>{0.7f, -0.4f, 1.1f, 0.3f, -0.9f, 0.5f});
+        write_dset(conv.get(), "bias",    {1},     vector<float>{0.2f});
+        write_string_array_attribute(conv.get(), "activation", {"Identity"});
+
+        auto sum = add_node(potential.get(), "scaled_sum", {"conv1d"});
+        write_float_attribute(sum.get(), ".", "scale", 1.f);
+    }
+
+    auto engine = load_engine(path, n_atom);
+
+    vector<float> pos;
+    for(int na: range(n_atom))
+        for(float x: {1.6f*cosf(1.9f*na), 1.6f*sinf(1.9f*na), 1.2f*na + 0.3f*sinf(0.7f*na)})
+            pos.push_back(x);
+    set_pos(engine, pos);
+    engine.compute(PotentialAndDerivMode);
+
+    auto& rama  = engine.get_computation<CoordNode>("rama_coord");
+    auto& hbond = engine.get_computation<CoordNode>("constant_hbond");
+    auto& feat  = engine.get_computation<CoordNode>("backbone_featurizer");
+    require(rama.output.layout() == Layout::SoA, "rama_coord is expected to have the SoA layout");
+
+    VecArraySoA ramac(rama.output);
+    VecArray hbondc = hbond.output;
+    VecArray featc  = feat.output;
+    for(int nr: range(n_res)) {
+        float phi = ramac(0,nr);
+        float psi = ramac(1,nr);
+        float don = nr%3==0 ? 0.f : hbondc(6,nr);
+        float acc = nr%2==0 ? 0.f : hbondc(6,(nr+2)%n_res);
+        float expected[6] = {sinf(phi), cosf(phi), sinf(psi), cosf(psi), don, acc};
+        for(int d: range(6))
+            require(fabsf(featc(d,nr)-expected[d]) < 1e-5f,
+                    "feature " + to_string(d) + " of residue " + to_string(nr) + " is " +
+                    to_string(featc(d,nr)) + " but expected " + to_string(expected[d]));
+    }
+
+    auto dev = deriv_deviation(engine, pos);
+    require(dev < 1e-2, "derivative deviates from central differences by " + to_string(dev));
+}
+
+
+// Two radial pair potentials on the same atoms, one of which reuses the edges of elements that
+// moved less than reuse_distance.  Along a trajectory of small steps, the reused energy must stay
+// within the first-order bound on the error of displacing each atom by up to reuse_distance, and
+// the graph without the attribute must not depend on the earlier positions.
+void test_edge_reuse(const string& path) {
+    int n_atom = 40;
+    float reuse_distance = 0.1f;
+
+    {
+        auto config = create_config(path);
+        auto potential = open_group(config.get(), "/input/potential");
+
+        // p[0] is the inverse knot spacing (cutoff 7A), then clamped spline coefficients
+        vector<float> param = {2.f,
+            2.0f, 1.6f, 2.0f, 1.2f, 0.6f, 0.1f, -0.3f, -0.5f, -0.4f, -0.3f, -0.2f, -0.1f, -0.05f, 0.f, 0.f, 0.f};
+        vector<int> index, type, id;
+        for(int na: range(n_atom)) {index.push_back(na); type.push_back(0); id.push_back(na);}
+
+        for(const char* name: {"radial_full", "radial_reuse"}) {
+            auto grp = add_node(potential.get(), name, {"pos"});
+            write_dset(grp.get(), "index", {hsize_t(n_atom)}, index);
+            write_dset(grp.get(), "type",  {hsize_t(n_atom)}, type);
+            write_dset(grp.get(), "id",    {hsize_t(n_atom)}, id);
+            write_dset(grp.get(), "interaction_param", {1,1,hsize_t(param.size())}, param);
+        }
+        write_float_attribute(potential.get(), "radial_reuse", "reuse_distance", reuse_distance);
+    }
+
+    auto engine = load_engine(path, n_atom);
+    auto& full  = engine.get_computation<PotentialNode>("radial_full");
+    auto& reuse = engine.get_computation<PotentialNode>("radial_reuse");
+
+    // jittered 4x5x2 grid with 3A spacing
+    mt19937 rng(1234u);
+    auto uniform = [&](float scale) {return scale*(2.f*float(rng()>>8)*(1.f/16777216.f)-1.f);};
+    vector<float> pos;
+    for(int na: range(n_atom))
+        for(int x: {na%4, (na/4)%5, na/20})
+            pos.push_back(3.f*x + uniform(0.5f));
+
+    int n_differ = 0;
+    for(int step: range(30)) {
+        if(step) for(auto& x: pos) x += uniform(0.03f);
+        set_pos(engine, pos);
+        engine.compute(PotentialAndDerivMode);
+
+        // the position sensitivity is the sum of the two nearly equal gradients, so this is about
+        // twice the first-order bound
+        auto sens = get_pos_sens(engine);
+        double grad_sum = 0.;
+        for(int na: range(n_atom)) grad_sum += sqrt(sqr(sens[na*3+0]) + sqr(sens[na*3+1]) + sqr(sens[na*3+2]));
+        double tolerance = reuse_distance*grad_sum;
+
+        double diff = fabs(double(reuse.potential) - double(full.potential));
+        require(diff <= tolerance,
+                "step " + to_string(step) + ": reused energy " + to_string(reuse.potential) +
+                " differs from the full recompute " + to_string(full.potential) + " by more than " +
+                to_string(tolerance));
+        n_differ += reuse.potential != full.potential;
+    }
+    require(n_differ > 0, "edges were never reused");
+
+    auto fresh = load_engine(path, n_atom);
+    set_pos(fresh, pos);
+    fresh.compute(PotentialAndDerivMode);
+    require(fresh.get_computation<PotentialNode>("radial_full").potential == full.potential,
+            "energy without reuse_distance depends on the earlier positions");
+}
+
+
+// environment_coverage -> uniform_transform -> nonlinear_coupling is an elementwise chain, so an
+// engine that fuses it must give bitwise the same energy and sensitivities as one that does not
+void test_fused_elementwise(const string& path) {
+    int n_atom = 30;  // sidechain beads, two per residue
+    int n_cb   = 15;
+
+    {
+        auto config = create_config(path);
+        auto potential = open_group(config.get(), "/input/potential");
+
+        mt19937 rng(4321u);
+        auto uniform = [&](float scale) {return scale*(2.f*float(rng()>>8)*(1.f/16777216.f)-1.f);};
+
+        // CB positions along a helix, each with a unit vector pointing away from the axis
+        vector<float> cb;
+        for(int nr: range(n_cb))
+            for(float x: {2.3f*cosf(1.75f*nr), 2.3f*sinf(1.75f*nr), 1.5f*nr, cosf(1.75f*nr), sinf(1.75f*nr), 0.f})
+                cb.push_back(x);
+        write_dset(add_node(potential.get(), "constant_cb", {}).get(), "value", {hsize_t(n_cb),6}, cb);
+
+        vector<float> sc_energy(n_atom);
+        for(auto& e: sc_energy) e = uniform(0.5f);
+        write_dset(add_node(potential.get(), "constant_sc_energy", {}).get(), "value",
+                {hsize_t(n_atom),1}, sc_energy);
+
+        vector<int> atom_index;
+        for(int na: range(n_atom)) atom_index.push_back(na);
+        auto weighted = add_node(potential.get(), "weighted_pos", {"pos", "constant_sc_energy"});
+        write_dset(weighted.get(), "index_pos",    {hsize_t(n_atom)}, atom_index);
+        write_dset(weighted.get(), "index_weight", {hsize_t(n_atom)}, atom_index);
+
+        vector<int> cb_index, cb_type, sc_type, sc_id;
+        for(int nr: range(n_cb))   {cb_index.push_back(nr); cb_type.push_back(0);}
+        for(int na: range(n_atom)) {sc_type.push_back(0); sc_id.push_back(na/2);}
+        auto coverage = add_node(potential.get(), "environment_coverage", {"constant_cb", "weighted_pos"});
+        write_dset(coverage.get(), "index1", {hsize_t(n_cb)},   cb_index);
+        write_dset(coverage.get(), "type1",  {hsize_t(n_cb)},   cb_type);
+        write_dset(coverage.get(), "id1",    {hsize_t(n_cb)},   cb_index);
+        write_dset(coverage.get(), "index2", {hsize_t(n_atom)}, atom_index);
+        write_dset(coverage.get(), "type2",  {hsize_t(n_atom)}, sc_type);
+        write_dset(coverage.get(), "id2",    {hsize_t(n_atom)}, sc_id);
+        // r0, r_sharpness, dot0, dot_sharpness
+        write_dset(coverage.get(), "interaction_param", {1,1,4}, vector<float>{6.f, 1.f, 0.f, 2.f});
+
+        auto transform = add_node(potential.get(), "uniform_transform", {"environment_coverage"});
+        write_dset(transform.get(), "bspline_coeff", {8},
+                vector<float>{0.f, 0.2f, 0.6f, 1.1f, 1.4f, 1.5f, 1.5f, 1.5f});
+        write_float_attribute(transform.get(), "bspline_coeff", "spline_offset", -0.5f);
+        write_float_attribute(transform.get(), "bspline_coeff", "spline_inv_dx", 2.f);
+
+        vector<int> coupling_types;
+        for(int nr: range(n_cb)) coupling_types.push_back(nr%2);
+        auto coupling = add_node(potential.get(), "nonlinear_coupling", {"uniform_transform"});
+        write_dset(coupling.get(), "coeff", {2,6}, vector<float>{
+                0.5f, 0.f, -0.8f, -1.2f, -1.0f, -1.0f,
+                -0.3f, 0.1f, 0.4f, 0.2f, -0.5f, -0.5f});
+        write_dset(coupling.get(), "coupling_types", {hsize_t(n_cb)}, coupling_types);
+        write_float_attribute(coupling.get(), "coeff", "spline_offset", -0.2f);
+        write_float_attribute(coupling.get(), "coeff", "spline_inv_dx", 2.5f);
+    }
+
+    auto fused   = load_engine(path, n_atom);
+    auto unfused = load_engine(path, n_atom);
+    unfused.set_fuse_elementwise(false);
+    unfused.build_exec_schedule();
+    require(fused.fused_chains.size() == 1u && unfused.fused_chains.empty(),
+            "expected exactly one fused chain");
+
+    // sidechain beads scattered around the helix
+    mt19937 rng(1234u);
+    auto uniform = [&](float scale) {return scale*(2.f*float(rng()>>8)*(1.f/16777216.f)-1.f);};
+    vector<float> pos;
+    for(int na: range(n_atom)) {
+        float t = 1.75f*(na/2);
+        for(float x: {4.f*cosf(t), 4.f*sinf(t), 1.5f*(na/2)}) pos.push_back(x + uniform(1.5f));
+    }
+
+    auto bitwise_equal = [](const vector<float>& a, const vector<float>& b) {
+        return a.size()==b.size() && !memcmp(a.data(), b.data(), a.size()*sizeof(float));};
+    auto root_sens = [](DerivEngine& engine) {
+        auto& node = engine.get_computation<CoordNode>("environment_coverage");
+        vector<float> sens;
+        for(int ne: range(node.n_elem)) sens.push_back(node.sens(0,ne));
+        return sens;
+    };
+
+    for(int step: range(6)) {
+        if(step) for(auto& x: pos) x += uniform(0.2f);
+        // alternate modes so that the potential-only path of the chain is covered too
+        auto mode = step%2 ? PotentialOnlyMode : PotentialAndDerivMode;
+        for(auto engine: {&fused, &unfused}) {
+            set_pos(*engine, pos);
+            engine->compute(mode);
+        }
+
+        require(!memcmp(&fused.potential, &unfused.potential, sizeof(float)),
+                "step " + to_string(step) + ": fused energy " + to_string(fused.potential) +
+                " differs from unfused energy " + to_string(unfused.potential));
+        require(fused.potential != 0.f, "the chain contributes no energy");
+        if(mode == PotentialAndDerivMode) {
+            require(bitwise_equal(root_sens(fused), root_sens(unfused)),
+                    "step " + to_string(step) + ": environment_coverage sensitivities differ");
+            require(bitwise_equal(get_pos_sens(fused), get_pos_sens(unfused)),
+                    "step " + to_string(step) + ": position derivatives differ");
+        }
+    }
+}
+
+}
+
+
+int main(int argc, const char* const* argv) {
+    map<string, function<void(const string&)>> tests;
+    tests["backbone_featurizer"] = test_backbone_featurizer;
+    tests["edge_reuse"]          = test_edge_reuse;
+    tests["fused_elementwise"]   = test_fused_elementwise;
+
+    if(argc != 2 || !tests.count(argv[1])) {
+        fprintf(stderr, "usage: %s test_name\ntests:", argv[0]);
+        for(auto& kv: tests) fprintf(stderr, " %s", kv.first.c_str());
+        fprintf(stderr, "\n");
+        return 2;
+    }
+
+    string name = argv[1];
+    try {
+        tests[name](name + ".h5");
+    } catch(const string& e) {
+        fprintf(stderr, "FAILED %s: %s\n", name.c_str(), e.c_str());
+        return 1;
+    } catch(const char* e) {
+        fprintf(stderr, "FAILED %s: %s\n", name.c_str(), e);
+        return 1;
+    }
+    printf("passed %s\n", name.c_str());
+    return 0;
+}
@@ -85,11 +85,18 @@ struct EnvironmentCoverage : public CoordNode {
     virtual void compute_value(ComputeMode mode) override {
         Timer timer(string("environment_coverage"));
 
-        igraph.compute_edges();
+        igraph.compute_edges(deriv_needed(mode));
 
+        // accumulate for each cb, one segment of edges per block of 4 cb's in the storage order
+        // of the graph; the fill also zeros the padding rows and any cb's without a segment
         fill(output, 0.f);
-        for(int ne=0; ne<igraph.n_edge; ++ne)  // accumulate for each cb
-            output(0, igraph.edge_indices1[ne]) += igraph.edge_value[ne];
+        const auto& block_start = igraph.pairlist.edge_block_start;
+        for(int b=0; b+1<int(block_start.size()); ++b) {
+            float sum[4] = {0.f, 0.f, 0.f, 0.f};
+            for(int ne=block_start[b]; ne<block_start[b+1]; ++ne)
+                sum[igraph.pairlist.edge_indices1[ne]&3] += igraph.edge_value[ne];
+            for(int j=0; j<4 && 4*b+j<n_elem; ++j) output(0,igraph.element1(4*b+j)) = sum[j];
+        }
     }
 
     virtual void propagate_deriv() override {
@@ -105,6 +112,7 @@ struct EnvironmentCoverage : public CoordNode {
     virtual std::vector<float> get_param_deriv() override {return igraph.get_param_deriv();}
 #endif
     virtual void set_param(const std::vector<float>& new_param) override {igraph.set_param(new_param);}
+    virtual void set_n_threads(int n_threads) override {igraph.set_n_threads(n_threads);}
 };
 static RegisterNodeType<EnvironmentCoverage,2> environment_coverage_node("environment_coverage");
 
@@ -160,8 +168,8 @@ struct UniformTransform : public CoordNode {
     int n_coeff;
     float spline_offset;
     float spline_inv_dx;
-    unique_ptr<float[]> bspline_coeff;
-    unique_ptr<float[]> jac;
+    aligned_array<float> bspline_coeff;
+    aligned_array<float> jac;
 
 
     UniformTransform(hid_t grp, CoordNode& input_):
@@ -194,6 +202,17 @@ struct UniformTransform : public CoordNode {
             input.sens(0,ne) += jac[ne]*sens(0,ne);
     }
 
+    virtual CoordNode* elementwise_input() override {return &input;}
+
+    virtual void transform_block(int start, int n, const float* x, float* y, float* dy_dx) override {
+        for(int i=0; i<n; ++i) {
+            auto coord = (x[i]-spline_offset)*spline_inv_dx;
+            auto v = clamped_deBoor_value_and_deriv(bspline_coeff.get(), coord, n_coeff);
+            y[i]     = v[0];
+            dy_dx[i] = v[1]*spline_inv_dx;
+        }
+    }
+
     virtual std::vector<float> get_param() const override{
         vector<float> ret(2+n_coeff);
         ret[0] = spline_offset;
@@ -294,6 +313,16 @@ struct LinearCoupling : public PotentialNode {
         potential = pot;
     }
 
+    virtual CoordNode* elementwise_input() override {return inactivation ? nullptr : &input;}
+
+    virtual void reduce_block(int start, int n, const float* x, float& pot, float* dpot_dx) override {
+        for(int i=0; i<n; ++i) {
+            float c = couplings[coupling_types[start+i]];
+            pot       += c * x[i];
+            dpot_dx[i] = c;
+        }
+    }
+
     virtual std::vector<float> get_param() const override {
         return couplings;
     }
@@ -368,6 +397,17 @@ struct NonlinearCoupling : public PotentialNode {
         potential = pot;
     }
 
+    virtual CoordNode* elementwise_input() override {return &input;}
+
+    virtual void reduce_block(int start, int n, const float* x, float& pot, float* dpot_dx) override {
+        for(int i=0; i<n; ++i) {
+            auto coord = (x[i]-spline_offset)*spline_inv_dx;
+            auto v = clamped_deBoor_value_and_deriv(coeff.data() + coupling_types[start+i]*n_coeff, coord, n_coeff);
+            pot       += v[0];
+            dpot_dx[i] = v[1]*spline_inv_dx;
+        }
+    }
+
     virtual std::vector<float> get_param() const override {
         return coeff;
     }
@@ -296,4 +296,15 @@ node_names_in_group(const hid_t loc, const std::string grp_name) {
     return names;
 }
 
+
+std::string object_basename(const hid_t loc) {
+    // 1+ is for NULL terminator
+    size_t name_size = 1 + h5_noerr(H5Iget_name(loc, nullptr, 0));
+    auto tmp = std::unique_ptr<char[]>(new char[name_size]);
+    h5_noerr(H5Iget_name(loc, tmp.get(), name_size));
+
+    std::string path(tmp.get());
+    return path.substr(path.rfind('/')+1);
+}
+
 }
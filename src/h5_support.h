@@ -160,6 +160,10 @@ std::vector<std::string>
 node_names_in_group(const hid_t loc, const std::string grp_name);
 
 
+//! Last component of the path of an object (empty if the object is anonymous)
+std::string object_basename(const hid_t loc);
+
+
 //! \cond
 template <int ndim, typename T, typename F>
 struct traverse_dataset_iteraction_helper { 
@@ -21,7 +21,7 @@ struct Infer_H_O : public CoordNode
     CoordNode& pos;
     int n_donor, n_acceptor, n_virtual;
     vector<Params> params;
-    unique_ptr<float[]> data_for_deriv;
+    aligned_array<float> data_for_deriv;
 
     Infer_H_O(hid_t grp, CoordNode& pos_):
         CoordNode(
@@ -292,7 +292,7 @@ struct ProteinHBond : public CoordNode
     CoordNode& infer;
     InteractionGraph<ProteinHBondInteraction> igraph;
     int n_donor, n_acceptor, n_virtual;
-    unique_ptr<float[]> sens_scaled;
+    aligned_array<float> sens_scaled;
 
     ProteinHBond(hid_t grp, CoordNode& infer_):
         CoordNode(get_dset_size(1,grp,"index1")[0]+get_dset_size(1,grp,"index2")[0], 7),
@@ -323,7 +323,7 @@ struct ProteinHBond : public CoordNode
         }
 
         // Compute protein hbonding score and its derivative
-        igraph.compute_edges();
+        igraph.compute_edges(deriv_needed(mode));
         for(int ne=0; ne<igraph.n_edge; ++ne) {
             int nd = igraph.edge_indices1[ne];
             int na = igraph.edge_indices2[ne];
@@ -364,6 +364,7 @@ struct ProteinHBond : public CoordNode
             update_vec(pd2, igraph.loc2[na], load_vec<6>(sens, na+n_donor));
         }
     }
+    virtual void set_n_threads(int n_threads) override {igraph.set_n_threads(n_threads);}
 };
 static RegisterNodeType<ProteinHBond,1> hbond_node("protein_hbond");
 
@@ -381,7 +382,7 @@ struct HBondCoverage : public CoordNode {
         Timer timer(string("hbond_coverage"));
 
         // Compute coverage and its derivative
-        igraph.compute_edges();
+        igraph.compute_edges(deriv_needed(mode));
 
         fill(output, 0.f);
         for(int ne=0; ne<igraph.n_edge; ++ne) {
@@ -402,6 +403,7 @@ struct HBondCoverage : public CoordNode {
     virtual std::vector<float> get_param_deriv() override {return igraph.get_param_deriv();}
 #endif
     virtual void set_param(const std::vector<float>& new_param) override {igraph.set_param(new_param);}
+    virtual void set_n_threads(int n_threads) override {igraph.set_n_threads(n_threads);}
 
     virtual vector<float> get_value_by_name(const char* log_name) override {
         if(!strcmp(log_name, "count_edges_by_type")) {
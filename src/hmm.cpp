@@ -128,7 +128,7 @@ struct FixedHMM : public PotentialNode
             // now put minimum in all elements of e_min Float4
             e_min = min(shuffle<0,1,0,1>(e_min), shuffle<2,3,2,3>(e_min));
             e_min = min(e_min.broadcast<0>(), e_min.broadcast<1>());
-            if(mode==PotentialAndDerivMode) pot += e_min.x();
+            if(potential_needed(mode)) pot += e_min.x();
 
             // write emmision probabilities
             float* p = &emission_prob(0,nr);
@@ -144,11 +144,11 @@ struct FixedHMM : public PotentialNode
             if(nr) forward = forward*transition_matrix;
             forward.array() *= Map<RowVectorXf>(&emission_prob(0,nr), n_state).array();
             float norm = forward.sum();
-            if(mode==PotentialAndDerivMode) pot -= logf(norm);
+            if(potential_needed(mode)) pot -= logf(norm);
             forward *= rcp(norm);
             Map<RowVectorXf>(&forward_belief(0,nr), n_state) = forward;
         }
-        if(mode==PotentialAndDerivMode) potential = pot;
+        if(potential_needed(mode)) potential = pot;
         // tforw.stop();
 
         // Timer tback("hmm_backward");
@@ -165,7 +165,7 @@ struct FixedHMM : public PotentialNode
             marginal *= rcp(marginal.sum());
             Map<VectorXf>(&sens(0,nr), n_state) += marginal;
 
-            if(mode==PotentialAndDerivMode) {
+            if(potential_needed(mode)) {
                 Map<VectorXf> en(&n1b(0,params[nr].index), n_state);
                 auto avg_energy_1body = marginal.dot(en);
                 auto entropy_1body =  marginal.dot((marginal+1e-8f*VectorXf::Ones(n_state)).array().log().matrix());
@@ -259,6 +259,7 @@ struct TorusDBN_Emission : public CoordNode {
         cs_to_emission(Matrix<float,6,Dynamic>::Zero(6,ru(n_state))),
         cs_sens       (Matrix<float,6,Dynamic>::Zero(6,n_residue))
     {
+        check_layout(rama, Layout::SoA);
         check_size(grp, "id", n_residue);
         check_size(grp, "restypes", n_residue);
         check_size(grp, "prior_offset_energies", n_restype, n_state);
@@ -295,7 +296,7 @@ struct TorusDBN_Emission : public CoordNode {
 
     virtual void compute_value(ComputeMode mode) {
         Timer timer(string("torus_dbn"));
-        VecArray rpos = rama.output;
+        VecArraySoA rpos(rama.output);
         for(int nr=0; nr<n_residue; ++nr) {
             float phi = rpos(0,params[nr].residue);
             float psi = rpos(1,params[nr].residue);
@@ -319,7 +320,7 @@ struct TorusDBN_Emission : public CoordNode {
         Map<Matrix<float,Dynamic,Dynamic,RowMajor>> state_sens(sens.x.get(), n_residue, ru(n_state));
         cs_sens = cs_to_emission*state_sens.transpose();
 
-        VecArray rsens = rama.sens;
+        VecArraySoA rsens(rama.sens);
         for(int nr=0; nr<n_residue; ++nr) {
             int i = params[nr].residue;
             // as we all learned long ago, d(cos) = -sin and d(sin) = cos
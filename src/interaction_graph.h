@@ -7,20 +7,86 @@
 #include "h5_support.h"
 #include "timing.h"
 #include <algorithm>
+#include <sstream>
 #include "Float4.h"
+#include "jit.h"
+#include "state_logger.h"
+#include <memory>
+#include <mutex>
 
 
 template <typename T>
-inline T* operator+(const std::unique_ptr<T[]>& ptr, int i) {
+inline T* operator+(const aligned_array<T>& ptr, int i) {
     // little function to make unique_ptr for an array do pointer arithmetic
     return ptr.get()+i;
 }
 
 template <typename T>
-void fill_n(std::unique_ptr<T[]> &ptr, int n_elem, const T& value) {
+void fill_n(aligned_array<T> &ptr, int n_elem, const T& value) {
     std::fill_n(ptr.get(), n_elem, value);
 }
 
+//! \brief Replace ptr by an allocation of n_elem elements that begins with the first n_keep elements of ptr
+template <typename T>
+void resize_aligned(aligned_array<T> &ptr, int n_keep, int n_elem, int alignment_elems) {
+    auto new_ptr = new_aligned<T>(n_elem, alignment_elems);
+    std::copy_n(ptr.get(), n_keep, new_ptr.get());
+    ptr = std::move(new_ptr);
+}
+
+//! \brief Capacity for an edge buffer that must hold n_needed edges
+//!
+//! Buffers grow by half their current capacity so that the cost of copying is amortized, but
+//! never beyond max_n_edge unless n_needed requires it.  Throws if n_needed exceeds max_n_edge
+//! by more than slack, which callers use for edges that are written before the limit is checked.
+inline int grow_edge_capacity(int capacity, int n_needed, int max_n_edge, int slack=0) {
+    if(n_needed > max_n_edge+slack)
+        throw std::string("edge list needs ") + std::to_string(n_needed) +
+            " edges, more than the max_n_edge of " + std::to_string(max_n_edge);
+    return round_up(std::max(n_needed, std::min(capacity + capacity/2, max_n_edge)), 16);
+}
+
+//! \brief Initial capacity for an edge buffer between sets of n_elem1 and n_elem2 elements
+inline int initial_edge_capacity(int n_elem1, int n_elem2, int max_n_edge) {
+    return round_up(std::min(4*(n_elem1+n_elem2), max_n_edge), 16);
+}
+
+//! \brief Default max_n_edge, which is the number of pairs (clamped to the range of int)
+inline int all_pairs_n_edge(int n_elem1, int n_elem2, bool symmetric) {
+    return int(std::min(int64_t(n_elem1)*int64_t(n_elem2)/(symmetric?2:1), int64_t(1)<<30));
+}
+
+//! \brief Order of n points along a Morton (Z-order) curve through their bounding box
+//!
+//! Point i is at pos[3*i].  Points that are close in space are mostly close in the returned
+//! order, and points in the same cell of the curve keep their relative order.
+inline std::vector<int32_t> morton_order(const float* pos, int n) {
+    float lo[3] = {0.f,0.f,0.f}, scale[3] = {0.f,0.f,0.f};
+    for(int d=0; d<3 && n; ++d) {
+        float hi = lo[d] = pos[d];
+        for(int i=1; i<n; ++i) {lo[d] = std::min(lo[d], pos[3*i+d]); hi = std::max(hi, pos[3*i+d]);}
+        if(hi > lo[d]) scale[d] = 1023.f/(hi-lo[d]);
+    }
+
+    // 10 bits per dimension, interleaved
+    auto spread_bits = [](uint32_t x) {
+        x = (x | (x<<16)) & 0x030000FFu;
+        x = (x | (x<< 8)) & 0x0300F00Fu;
+        x = (x | (x<< 4)) & 0x030C30C3u;
+        x = (x | (x<< 2)) & 0x09249249u;
+        return x;
+    };
+    std::vector<uint32_t> code(n, 0u);
+    for(int i=0; i<n; ++i)
+        for(int d=0; d<3; ++d)
+            code[i] |= spread_bits(uint32_t(std::min(1023.f, std::max(0.f, (pos[3*i+d]-lo[d])*scale[d])))) << d;
+
+    std::vector<int32_t> order(n);
+    for(int i=0; i<n; ++i) order[i] = i;
+    std::stable_sort(order.begin(), order.end(), [&](int32_t i, int32_t j) {return code[i] < code[j];});
+    return order;
+}
+
 template <typename T>
 static T&& message(const std::string& s, T&& x) {
     printf("%s", s.c_str());
@@ -28,208 +94,1009 @@ static T&& message(const std::string& s, T&& x) {
 }
 
 
+#ifndef CELL_LIST_MIN_PAIRS
+// Below this many pairs, the SIMD all-pairs rebuild is faster than a cell-list rebuild (about
+// 4000 elements for a symmetric pairlist at protein density)
+#define CELL_LIST_MIN_PAIRS 8e6f
+#endif
+
+typedef Int4(*acceptable_id_pair_t)(const Int4&,const Int4&);
+
+// Cost of refining one cached edge relative to one rebuild test of a block of 4 first elements
+// against a second element.  Both are a 4-wide distance test, but refinement gathers positions.
+#ifndef PAIRLIST_REFINE_COST
+#define PAIRLIST_REFINE_COST 1.f
+#endif
+
+//! \brief Counts accumulated by a PairlistCache
+struct PairlistStats {
+    long   n_step;        //!< validity checks of the cache
+    long   n_rebuild;     //!< cache rebuilds
+    double n_test;        //!< rebuild tests of a block of 4 first elements against a second element
+    double n_candidate;   //!< cached edges examined by the consumers, summed over steps
+    double n_accepted;    //!< edges within the cutoff of the consumers, summed over steps
+
+    PairlistStats(): n_step(0), n_rebuild(0), n_test(0.), n_candidate(0.), n_accepted(0.) {}
+};
+
+//! \brief Positions of a block of 4 elements on a grid, as 16-bit offsets from an origin
+//!
+//! The origin is a multiple of the grid spacing, so each position is a grid point that is
+//! represented exactly and does not change if the block is given a new origin.
+struct QuantizedBlock {
+    float    origin[3];
+    int32_t  far;      //!< bit j is set if element j is padding or not finite, which decodes as 1e10
+    uint16_t q[3][4];  //!< offset of each element from origin in grid steps, by dimension
+};
+
+inline Int4 load_index4(const int32_t* p) {return Int4(p);}
+inline Int4 load_index4(const uint16_t* p) {
+    alignas(16) int32_t v[4] = {p[0], p[1], p[2], p[3]};
+    return Int4(v);
+}
+
+//! \brief Candidate edges within a cutoff plus a buffer, refined by one or more PairlistComputation's
+//!
+//! Pairlists of an engine with the same nodes, indices, and ids share a cache (see
+//! PairlistComputation::share_cache).  The cache is built at the largest cutoff of its
+//! consumers, and each consumer refines it at its own cutoff.  If the consumers exclude
+//! id pairs by different rules, the cache keeps every id pair and each consumer applies its
+//! own rule during refinement.
+//!
+//! A compact cache (see set_compact) keeps its positions as QuantizedBlock's and, if there are
+//! at most 65536 elements in each set, its edges as 16-bit indices.  The quantized positions
+//! are the reference for both the validity check and the rebuild, so the cache still holds
+//! every pair within the cutoff and the refined edges are the same as for a full-precision cache.
 template <bool symmetric>
-struct PairlistComputation {
-    typedef Int4(*acceptable_id_pair_t)(const Int4&,const Int4&);
+struct PairlistCache {
     public:
         const int n_elem1, n_elem2;
-        std::unique_ptr<int32_t[]>  edge_indices1, edge_indices2;
-        std::unique_ptr<int32_t[]>  edge_id1,      edge_id2;
-        int n_edge;
+        const int max_n_edge;  // limit on the number of cached edges
+
+        PairlistStats stats;  //!< statistics since construction
+
+        //! \brief Tune the cache buffer online to minimize rebuild plus refine work per step
+        bool adaptive_buffer;
+
+        //! \brief Rebuilds with at least this many candidate pairs use the cell list
+        float cell_list_min_pairs;
+
+        //! \brief Number of OpenMP tasks for rebuilds, which does not change the edges
+        int n_threads;
+
+        //! \brief Rule used to exclude id pairs from the cache (nullptr if consumers differ)
+        acceptable_id_pair_t id_filter;
+
+        float cutoff;        // largest cutoff of the consumers
+        float cache_cutoff;  // cutoff used to build the cache
+
+        // Cached edges, in cache_edge_short* if short_indices and in cache_edge_indices* otherwise
+        bool short_indices;
+        aligned_array<int32_t>  cache_edge_indices1, cache_edge_indices2;
+        aligned_array<uint16_t> cache_edge_short1,   cache_edge_short2;
+        int cache_n_edge;
+        int cache_capacity;  // allocated length of the cache edge arrays
 
     protected:
+        std::mutex mutex;
+        const uint64_t* epoch;   // compute counter of the engine (nullptr to check on every call)
+        uint64_t checked_epoch;  // epoch of the last validity check
+        std::vector<float> consumer_cutoffs;
+
         bool cache_valid;
         float cache_buffer;
-        float cache_cutoff;
-        std::unique_ptr<float[]>    cache_pos1, cache_pos2;
-        std::unique_ptr<int32_t[]>  cache_id1,  cache_id2;
-        std::unique_ptr<int32_t[]>  cache_edge_indices1, cache_edge_indices2;
-        std::unique_ptr<int32_t[]>  cache_edge_id1,      cache_edge_id2;
-        int cache_n_edge;
+        float base_buffer;        // value set with change_cache_buffer
+        PairlistStats window;     // statistics since the last change of cache_buffer
+        float adapt_step;         // multiplicative change of cache_buffer, < 1 to shrink
+        double last_window_cost;  // work per step in the previous window (0 if none)
+
+        aligned_array<float>    cache_pos1, cache_pos2;
+        aligned_array<int32_t>  cache_id1,  cache_id2;
+
+        // A compact cache keeps its positions in qpos1/qpos2.  They are decoded to cache_pos1/
+        // cache_pos2 for the duration of a rebuild, which are released afterwards along with the
+        // chunk buffers, so that only the compact data is kept between rebuilds.
+        bool compact;
+        float quantum;  // grid spacing of qpos1/qpos2, a power of 2
+        std::vector<QuantizedBlock> qpos1, qpos2;
+
+        // A larger buffer makes rebuilds rarer but gives more candidates to refine every step.
+        // The optimum depends on the temperature, time step, and density, so it is found by
+        // hill climbing on the cost per step, with one buffer value per window of rebuilds.  The
+        // cost is counted in pair tests rather than measured in seconds, so that the buffer and the
+        // steps at which the cache is rebuilt are reproducible.  The edges produced do not depend on
+        // the buffer.
+        void adapt_cache_buffer() {
+            const int window_rebuilds = 8;
+            if(!adaptive_buffer || window.n_rebuild < window_rebuilds) return;
+
+            double cost = (window.n_test + PAIRLIST_REFINE_COST*window.n_candidate) / window.n_step;
+            if(last_window_cost > 0. && cost > last_window_cost) adapt_step = 1.f/adapt_step;
+            last_window_cost = cost;
+
+            cache_buffer = std::min(std::max(cache_buffer*adapt_step, 0.5f*base_buffer), 2.f*base_buffer);
+            window = PairlistStats();
+        }
 
-        template<acceptable_id_pair_t acceptable_id_pair>
-        void ensure_cache_valid(
-                float cutoff,
-                const float* aligned_pos1, const int pos1_stride, int* id1, 
-                const float* aligned_pos2, const int pos2_stride, int* id2)
-        {
-            Timer t1("pairlist_cache_check");
-            // Find maximum deviation from cached positions to determine if cache must be rebuilt
-            auto max_dist_exceeded = Float4();
-            auto id_changed = Int4();
-            auto max_cache_dist2 = Float4(sqr(0.5f*(cache_cutoff - cutoff)));
+        // Cached edges are ordered by block of 4 first elements, then by second element, then by
+        // lane.  The refined edge list inherits this order, so it does not depend on which
+        // candidates happen to be cached.  This allows rows of the cache to be replaced without
+        // changing the result.
+        std::vector<int32_t> cache_block_start;  // first cached edge of each block of 4 first elements
+        long full_rebuild_tests;                 // pair tests in the last full rebuild
+        long last_rebuild_tests;                 // pair tests in the last full or partial rebuild
+
+        // Elements found by the validity check to have moved past half the buffer or changed id
+        std::vector<int32_t> moved1, moved2;
+        std::vector<char>    moved_col;  // for each second element, whether it is a moved column
+
+        // Rebuilds split the blocks into consecutive chunks that are run as OpenMP tasks.  Each
+        // chunk writes its edges to its own buffer, and the buffers are concatenated in chunk
+        // order, so the cache is identical for any number of chunks.  The caller holds the mutex
+        // of the cache while it waits for the tasks, but since the engine's tasks are tied, the
+        // waiting thread only runs these tasks and never another consumer of the cache.
+        struct RebuildChunk {
+            std::vector<int32_t> indices1, indices2;
+            std::vector<int32_t> block_start;  // starts of the blocks of the chunk in a partial rebuild
+            std::vector<uint64_t> cell_mask;   // bit set of candidate elements for the current block
+            int  n_edge;
+            long n_test;
+
+            void reserve(size_t n) {
+                if(indices1.size() >= n) return;
+                n += n/2;
+                indices1.resize(n); indices2.resize(n);
+            }
+
+            void release() {
+                std::vector<int32_t>().swap(indices1);
+                std::vector<int32_t>().swap(indices2);
+            }
+        };
+        std::vector<RebuildChunk> chunks;
+
+        int n_rebuild_chunk(int n_block) const {
+            // a chunk must have enough blocks to be worth a task
+            return std::max(1, std::min(n_threads, n_block/16));
+        }
+
+        // Run rebuild_chunk(nc, block_start, block_end) for each chunk of the blocks
+        template <typename F>
+        void for_each_chunk(int n_chunk, int n_block, F&& rebuild_chunk) {
+            chunks.resize(std::max(size_t(n_chunk), chunks.size()));
+            int chunk_size = (n_block+n_chunk-1)/n_chunk;
+            if(n_chunk>1) {
+                #pragma omp taskloop grainsize(1)
+                for(int nc=0; nc<n_chunk; ++nc)
+                    rebuild_chunk(nc, nc*chunk_size, std::min(n_block, (nc+1)*chunk_size));
+            } else {
+                rebuild_chunk(0, 0, n_block);
+            }
+        }
+
+        // Append the edges of chunks [nc_start,n_chunk) to the cache after the first ne edges,
+        // shifting their block starts.  Returns the new number of edges.
+        int append_chunks(int ne, int nc_start, int n_chunk, int n_block) {
+            int chunk_size = (n_block+n_chunk-1)/n_chunk;
+            int n_total = ne;
+            for(int nc=nc_start; nc<n_chunk; ++nc) n_total += chunks[nc].n_edge;
+            reserve_cache(round_up(n_total,4), ne);
+
+            for(int nc=nc_start; nc<n_chunk; ++nc) {
+                const RebuildChunk& ch = chunks[nc];
+                for(int b=nc*chunk_size; b<std::min(n_block, (nc+1)*chunk_size); ++b)
+                    cache_block_start[b] += ne;
+                if(short_indices) {
+                    std::copy_n(ch.indices1.data(), ch.n_edge, cache_edge_short1+ne);
+                    std::copy_n(ch.indices2.data(), ch.n_edge, cache_edge_short2+ne);
+                } else {
+                    std::copy_n(ch.indices1.data(), ch.n_edge, cache_edge_indices1+ne);
+                    std::copy_n(ch.indices2.data(), ch.n_edge, cache_edge_indices2+ne);
+                }
+                ne += ch.n_edge;
+            }
+            return ne;
+        }
 
-            for(int i=0; i<n_elem1; i+=4) {
-                auto x = Float4(aligned_pos1+pos1_stride*(i+0)) - Float4(cache_pos1+4*(i+0));
-                auto y = Float4(aligned_pos1+pos1_stride*(i+1)) - Float4(cache_pos1+4*(i+1));
-                auto z = Float4(aligned_pos1+pos1_stride*(i+2)) - Float4(cache_pos1+4*(i+2));
-                auto w = Float4(aligned_pos1+pos1_stride*(i+3)) - Float4(cache_pos1+4*(i+3));
+        // Make room for n_needed cached edges, keeping the first n_keep.  Up to slack edges beyond
+        // max_n_edge are allowed, since a block may write its edges before the limit is checked.
+        void reserve_cache(int n_needed, int n_keep, int slack=0) {
+            if(n_needed <= cache_capacity) return;
+            cache_capacity = grow_edge_capacity(cache_capacity, n_needed, max_n_edge, slack);
+            if(short_indices) {
+                for(auto a: {&cache_edge_short1, &cache_edge_short2})
+                    resize_aligned(*a, n_keep, cache_capacity, 8);
+            } else {
+                for(auto a: {&cache_edge_indices1, &cache_edge_indices2})
+                    resize_aligned(*a, n_keep, cache_capacity, 4);
+            }
+        }
+
+        int32_t cached_index1(int e) const {return short_indices ? cache_edge_short1[e] : cache_edge_indices1[e];}
+        int32_t cached_index2(int e) const {return short_indices ? cache_edge_short2[e] : cache_edge_indices2[e];}
+
+        // Grid spacing for quantized positions: a power of 2 that is fine compared to any buffer
+        // unless that would not fit a block into 16 bits or would make the grid points inexact
+        static void grid_extent(const float* pos, int stride, int n, float& max_extent, float& max_abs) {
+            for(int i=0; i<n; i+=4) {
+                for(int d=0; d<3; ++d) {
+                    float lo = 1e30f, hi = -1e30f;
+                    for(int j=0; j<4 && i+j<n; ++j) {
+                        float x = pos[stride*(i+j)+d];
+                        if(!(std::fabs(x) < 1e30f)) continue;
+                        lo = std::min(lo, x);
+                        hi = std::max(hi, x);
+                        max_abs = std::max(max_abs, std::fabs(x));
+                    }
+                    max_extent = std::max(max_extent, hi-lo);
+                }
+            }
+        }
+
+        // Put the positions x (nullptr for padding) on the grid as block qb.  Returns false if
+        // they do not fit in 16 bits.
+        bool encode_block(QuantizedBlock& qb, const float* const x[4]) const {
+            // std::isfinite is not reliable under -ffast-math, so a magnitude test is used instead
+            auto finite = [](const float* v) {return std::fabs(v[0])<1e30f && std::fabs(v[1])<1e30f && std::fabs(v[2])<1e30f;};
+            qb.far = 0;
+            for(int j=0; j<4; ++j) if(!x[j] || !finite(x[j])) qb.far |= 1<<j;
+
+            for(int d=0; d<3; ++d) {
+                float lo = 1e30f;
+                for(int j=0; j<4; ++j) if(!((qb.far>>j)&1)) lo = std::min(lo, x[j][d]);
+                qb.origin[d] = qb.far==15 ? 0.f : std::floor(lo/quantum)*quantum;
+                for(int j=0; j<4; ++j) {
+                    float q = (qb.far>>j)&1 ? 0.f : std::floor((x[j][d]-qb.origin[d])/quantum + 0.5f);
+                    if(!(q>=0.f && q<=65535.f)) return false;
+                    qb.q[d][j] = uint16_t(q);
+                }
+            }
+            return true;
+        }
+
+        // Positions of the block as one Float4 per dimension
+        Vec<3,Float4> decode_block(const QuantizedBlock& qb) const {
+            Vec<3,Float4> x;
+            for(int d=0; d<3; ++d) {
+                alignas(16) float v[4];
+                for(int j=0; j<4; ++j) v[j] = (qb.far>>j)&1 ? 1e10f : qb.origin[d] + quantum*float(qb.q[d][j]);
+                x[d] = Float4(v);
+            }
+            return x;
+        }
+
+        void encode_positions(std::vector<QuantizedBlock>& qpos, const float* aligned_pos, int pos_stride, int n_elem) {
+            qpos.resize((n_elem+3)/4);
+            for(int i=0; i<n_elem; i+=4) {
+                const float* x[4];
+                for(int j=0; j<4; ++j) x[j] = i+j<n_elem ? aligned_pos+pos_stride*(i+j) : nullptr;
+                if(!encode_block(qpos[i/4], x))
+                    throw std::string("quantized pairlist positions do not fit the grid");  // prevented by the choice of quantum
+            }
+        }
+
+        // Move element i of qpos to x, giving its block a new origin if needed.  Returns false if
+        // the block no longer fits in 16 bits.
+        bool encode_moved(std::vector<QuantizedBlock>& qpos, int i, const float* x, int n_elem) {
+            auto old_x = decode_block(qpos[i/4]);
+            alignas(16) float v[4][3];
+            const float* xs[4];
+            for(int j=0; j<4; ++j) {
+                for(int d=0; d<3; ++d) v[j][d] = extract_float(old_x[d], j);
+                xs[j] = 4*(i/4)+j<n_elem ? v[j] : nullptr;
+            }
+            xs[i%4] = x;
+            return encode_block(qpos[i/4], xs);
+        }
+
+        // Decode the quantized positions into cache_pos1/cache_pos2 for a rebuild
+        void decode_positions() {
+            for(int set=0; set<(symmetric?1:2); ++set) {
+                const auto& qpos = set ? qpos2 : qpos1;
+                auto& pos = set ? cache_pos2 : cache_pos1;
+                int n_pos = round_up(set ? n_elem2 : n_elem1, 16)*4;
+                pos = new_aligned<float>(n_pos, 4);
+                std::fill_n(pos.get(), n_pos, 1e10f);
+                for(size_t b=0; b<qpos.size(); ++b) {
+                    auto x = decode_block(qpos[b]);
+                    for(int j=0; j<4; ++j)
+                        for(int d=0; d<4; ++d) pos[(4*b+j)*4+d] = d<3 ? extract_float(x[d], j) : 0.f;
+                }
+            }
+        }
 
+        void release_rebuild_buffers() {
+            if(!compact) return;
+            cache_pos1.reset();
+            cache_pos2.reset();
+            for(auto& ch: chunks) ch.release();
+        }
+
+        static void append_moved(std::vector<int32_t>& moved, int i, int bits, int n_elem) {
+            for(int j=0; j<4; ++j) if(((bits>>j)&1) && i+j<n_elem) moved.push_back(i+j);
+        }
+
+        // Tests of a block of 4 cached first elements against single cached second elements
+        template<acceptable_id_pair_t acceptable_id_pair>
+        struct BlockTester {
+            Vec<3,Float4> x1;
+            Int4 my_id1, i1_vec;
+            Float4 cutoff2;
+            const float* cpos2;
+            const int32_t* cid2;
+
+            BlockTester(const PairlistCache& c, int32_t i1, Float4 cutoff2_):
+                my_id1(c.cache_id1+i1),
+                cutoff2(cutoff2_),
+                cpos2(symmetric ? c.cache_pos1.get() : c.cache_pos2.get()),
+                cid2 (symmetric ? c.cache_id1.get()  : c.cache_id2.get())
+            {
+                alignas(16) int32_t offset_v[4] = {0,1,2,3};
+                i1_vec = Int4(i1) + Int4(offset_v);
+
+                Float4 v0(c.cache_pos1+(i1+0)*4), // aligned_pos1 size was rounded up
+                       v1(c.cache_pos1+(i1+1)*4),
+                       v2(c.cache_pos1+(i1+2)*4),
+                       v3(c.cache_pos1+(i1+3)*4);
+                transpose4(v0,v1,v2,v3); // v3 will be unused at the end
+                x1 = make_vec3(v0,v1,v2);
+            }
+
+            // Append the acceptable pairs of the block with i2 to the output arrays at ne
+            void operator()(int32_t i2, int32_t* o_indices1, int32_t* o_indices2, int& ne) const {
+                const float* p = cpos2+i2*4;
+                auto  x2 = make_vec3(Float4(p[0]), Float4(p[1]),  Float4(p[2]));
+                auto near = mag2(x1-x2)<cutoff2;
+                if(near.none()) return;
+
+                auto my_id2 = Int4(cid2[i2]);
+                auto i2_vec = Int4(i2);
+
+                Int4 is_hit = acceptable_id_pair(my_id1,my_id2) & (symmetric
+                    ? (i1_vec<i2_vec) & near.cast_int()
+                    :                   near.cast_int());
+                int is_hit_bits = is_hit.movemask();
+
+                // i2_vec is constant, so we don't have to left pack
+                // left_pack requires a read, so do before the writes
+
+                // write out pairs
+                int n_hit = popcnt_nibble(is_hit_bits);
+                i1_vec.left_pack(is_hit_bits).store(o_indices1+ne, Alignment::unaligned);
+                i2_vec                       .store(o_indices2+ne, Alignment::unaligned);
+                ne += n_hit;
+            }
+        };
+
+        void find_moved_quantized(const std::vector<QuantizedBlock>& qpos, const float* aligned_pos, int pos_stride,
+                const int* id, const int32_t* cid, int n_elem, Float4 max_cache_dist2, std::vector<int32_t>& moved) const {
+            for(int i=0; i<n_elem; i+=4) {
+                auto x = Float4(aligned_pos+pos_stride*(i+0));
+                auto y = Float4(aligned_pos+pos_stride*(i+1));
+                auto z = Float4(aligned_pos+pos_stride*(i+2));
+                auto w = Float4(aligned_pos+pos_stride*(i+3));
                 transpose4(x,y,z,w);
-                max_dist_exceeded |= max_cache_dist2 < x*x+y*y+z*z;
 
-                // To ensure the caching is completely transparent, we must also ensure that the id's have not 
-                // changed.  Hopefully, this check is quite quick.
-                id_changed |= Int4(id1+i)!=Int4(cache_id1+i);
+                auto cached = decode_block(qpos[i/4]);
+                x -= cached[0]; y -= cached[1]; z -= cached[2];
+                int moved_bits = (max_cache_dist2 < x*x+y*y+z*z).movemask() |
+                                 (Int4(id+i)!=Int4(cid+i)).movemask();
+                if(moved_bits) append_moved(moved, i, moved_bits, n_elem);
             }
-            if(!symmetric) {
-                for(int i=0; i<n_elem2; i+=4) {
-                    auto x = Float4(aligned_pos2+pos2_stride*(i+0)) - Float4(cache_pos2+4*(i+0));
-                    auto y = Float4(aligned_pos2+pos2_stride*(i+1)) - Float4(cache_pos2+4*(i+1));
-                    auto z = Float4(aligned_pos2+pos2_stride*(i+2)) - Float4(cache_pos2+4*(i+2));
-                    auto w = Float4(aligned_pos2+pos2_stride*(i+3)) - Float4(cache_pos2+4*(i+3));
+        }
+
+        // Returns true if the cache was rebuilt
+        template<acceptable_id_pair_t acceptable_id_pair>
+        bool check_and_rebuild(
+                const float* aligned_pos1, const int pos1_stride, int* id1,
+                const float* aligned_pos2, const int pos2_stride, int* id2)
+        {
+            Timer t1("pairlist_cache_check");
+            // Find elements that deviate too far from their cached positions
+            auto max_cache_dist2 = Float4(sqr(0.5f*(cache_cutoff - cutoff)));
+            moved1.clear();
+            moved2.clear();
+
+            if(compact) {
+                // a compact cache has no positions until it is first built
+                if(cache_valid) find_moved_quantized(qpos1, aligned_pos1, pos1_stride, id1, cache_id1.get(), n_elem1, max_cache_dist2, moved1);
+                if(cache_valid && !symmetric)
+                    find_moved_quantized(qpos2, aligned_pos2, pos2_stride, id2, cache_id2.get(), n_elem2, max_cache_dist2, moved2);
+            } else {
+                for(int i=0; i<n_elem1; i+=4) {
+                    auto x = Float4(aligned_pos1+pos1_stride*(i+0)) - Float4(cache_pos1+4*(i+0));
+                    auto y = Float4(aligned_pos1+pos1_stride*(i+1)) - Float4(cache_pos1+4*(i+1));
+                    auto z = Float4(aligned_pos1+pos1_stride*(i+2)) - Float4(cache_pos1+4*(i+2));
+                    auto w = Float4(aligned_pos1+pos1_stride*(i+3)) - Float4(cache_pos1+4*(i+3));
 
                     transpose4(x,y,z,w);
-                    max_dist_exceeded |= max_cache_dist2 < x*x+y*y+z*z;
-                    id_changed |= Int4(id2+i)!=Int4(cache_id2+i);
+
+                    // To ensure the caching is completely transparent, we must also ensure that the id's have not
+                    // changed.  Hopefully, this check is quite quick.
+                    int moved_bits = (max_cache_dist2 < x*x+y*y+z*z).movemask() |
+                                     (Int4(id1+i)!=Int4(cache_id1+i)).movemask();
+                    if(moved_bits) append_moved(moved1, i, moved_bits, n_elem1);
+                }
+                if(!symmetric) {
+                    for(int i=0; i<n_elem2; i+=4) {
+                        auto x = Float4(aligned_pos2+pos2_stride*(i+0)) - Float4(cache_pos2+4*(i+0));
+                        auto y = Float4(aligned_pos2+pos2_stride*(i+1)) - Float4(cache_pos2+4*(i+1));
+                        auto z = Float4(aligned_pos2+pos2_stride*(i+2)) - Float4(cache_pos2+4*(i+2));
+                        auto w = Float4(aligned_pos2+pos2_stride*(i+3)) - Float4(cache_pos2+4*(i+3));
+
+                        transpose4(x,y,z,w);
+                        int moved_bits = (max_cache_dist2 < x*x+y*y+z*z).movemask() |
+                                         (Int4(id2+i)!=Int4(cache_id2+i)).movemask();
+                        if(moved_bits) append_moved(moved2, i, moved_bits, n_elem2);
+                    }
                 }
             }
             t1.stop();
 
             // We don't do early bailout since the cache should be valid most of the time
-            if(cache_valid && max_dist_exceeded.none() && id_changed.none()) return;
+            if(cache_valid && moved1.empty() && moved2.empty()) return false;
             // printf("cache rebuild\n");
 
-            // If we reach here, we must rebuild the cache
+            // If we reach here, we must rebuild at least part of the cache
 
             Timer t2("pairlist_cache_rebuild");
+            adapt_cache_buffer();
+
+            // Only the rows and columns of moved elements must be recomputed, but every pair must be
+            // tested again if the cache cutoff changes.  A partial rebuild tests each moved first
+            // element against all second elements and each moved second element against all
+            // blocks, so it is only used if that is less work than the last full rebuild.
+            const int n_block = (n_elem1+3)/4;
+            const int n_elem2_eff = symmetric ? n_elem1 : n_elem2;
+            const auto& moved_cols = symmetric ? moved1 : moved2;
+            if(cache_valid && cache_cutoff == cutoff + cache_buffer) {
+                int n_dirty_block = 0;
+                for(size_t k=0; k<moved1.size(); ++k)
+                    n_dirty_block += !k || moved1[k]/4 != moved1[k-1]/4;
+                double partial_tests = double(n_dirty_block)*n_elem2_eff +
+                    double(n_block-n_dirty_block)*moved_cols.size() + 0.25*cache_n_edge;
+                // a compact cache must also fit the new positions of the moved elements into their blocks
+                bool partial = partial_tests < full_rebuild_tests;
+                if(partial && compact) {
+                    for(int i: moved1) partial = partial && encode_moved(qpos1, i, aligned_pos1+pos1_stride*i, n_elem1);
+                    for(int i: moved2) partial = partial && encode_moved(qpos2, i, aligned_pos2+pos2_stride*i, n_elem2);
+                }
+                if(partial) {
+                    last_rebuild_tests = long(partial_tests);
+                    if(compact) decode_positions();
+                    rebuild_moved<acceptable_id_pair>(aligned_pos1, pos1_stride, id1, aligned_pos2, pos2_stride, id2);
+                    release_rebuild_buffers();
+                    return true;
+                }
+            }
+
             // Store the new cache positions
             cache_cutoff = cutoff + cache_buffer;
 
-            for(int i=0; i<n_elem1; i+=4) {
-                Float4(aligned_pos1+pos1_stride*(i+0)).store(cache_pos1+4*(i+0));
-                Float4(aligned_pos1+pos1_stride*(i+1)).store(cache_pos1+4*(i+1));
-                Float4(aligned_pos1+pos1_stride*(i+2)).store(cache_pos1+4*(i+2));
-                Float4(aligned_pos1+pos1_stride*(i+3)).store(cache_pos1+4*(i+3));
-                Int4(id1+i).store(cache_id1+i);
-            }
-            if(!symmetric) {
-                for(int i=0; i<n_elem2; i+=4) {
-                    Float4(aligned_pos2+pos2_stride*(i+0)).store(cache_pos2+4*(i+0));
-                    Float4(aligned_pos2+pos2_stride*(i+1)).store(cache_pos2+4*(i+1));
-                    Float4(aligned_pos2+pos2_stride*(i+2)).store(cache_pos2+4*(i+2));
-                    Float4(aligned_pos2+pos2_stride*(i+3)).store(cache_pos2+4*(i+3));
-                    Int4(id2+i).store(cache_id2+i);
+            if(compact) {
+                float max_extent = 0.f, max_abs = 0.f;
+                grid_extent(aligned_pos1, pos1_stride, n_elem1, max_extent, max_abs);
+                if(!symmetric) grid_extent(aligned_pos2, pos2_stride, n_elem2, max_extent, max_abs);
+                quantum = 1.f/256.f;
+                while(quantum*65000.f < max_extent || quantum*float(1<<22) < max_abs) quantum *= 2.f;
+
+                encode_positions(qpos1, aligned_pos1, pos1_stride, n_elem1);
+                if(!symmetric) encode_positions(qpos2, aligned_pos2, pos2_stride, n_elem2);
+                decode_positions();
+
+                for(int i=0; i<n_elem1; i+=4) Int4(id1+i).store(cache_id1+i);
+                if(!symmetric) for(int i=0; i<n_elem2; i+=4) Int4(id2+i).store(cache_id2+i);
+            } else {
+                for(int i=0; i<n_elem1; i+=4) {
+                    Float4(aligned_pos1+pos1_stride*(i+0)).store(cache_pos1+4*(i+0));
+                    Float4(aligned_pos1+pos1_stride*(i+1)).store(cache_pos1+4*(i+1));
+                    Float4(aligned_pos1+pos1_stride*(i+2)).store(cache_pos1+4*(i+2));
+                    Float4(aligned_pos1+pos1_stride*(i+3)).store(cache_pos1+4*(i+3));
+                    Int4(id1+i).store(cache_id1+i);
+                }
+                if(!symmetric) {
+                    for(int i=0; i<n_elem2; i+=4) {
+                        Float4(aligned_pos2+pos2_stride*(i+0)).store(cache_pos2+4*(i+0));
+                        Float4(aligned_pos2+pos2_stride*(i+1)).store(cache_pos2+4*(i+1));
+                        Float4(aligned_pos2+pos2_stride*(i+2)).store(cache_pos2+4*(i+2));
+                        Float4(aligned_pos2+pos2_stride*(i+3)).store(cache_pos2+4*(i+3));
+                        Int4(id2+i).store(cache_id2+i);
+                    }
                 }
             }
 
             // Find all cache pairs
-            alignas(16) int32_t offset_v[4] = {0,1,2,3};
-            Int4 offset(offset_v);
             auto cutoff2 = Float4(sqr(cache_cutoff));
 
-            int ne = 0;
-            for(int32_t i1=0; i1<n_elem1; i1+=4) {
-                Float4 v0(cache_pos1+(i1+0)*4), // aligned_pos1 size was rounded up
-                       v1(cache_pos1+(i1+1)*4), 
-                       v2(cache_pos1+(i1+2)*4), 
-                       v3(cache_pos1+(i1+3)*4);
-                transpose4(v0,v1,v2,v3); // v3 will be unused at the end
-                auto  x1 = make_vec3(v0,v1,v2);
-
-                auto  my_id1 = Int4(cache_id1+i1);
-                auto  i1_vec = Int4(i1) + offset;
-
-                for(int32_t i2=symmetric?i1+1:0; i2<n_elem2; ++i2) {
-                    const float* p = (symmetric?cache_pos1:cache_pos2)+i2*4;
-                    auto  x2 = make_vec3(Float4(p[0]), Float4(p[1]),  Float4(p[2]));
-                    auto near = mag2(x1-x2)<cutoff2;
-                    if(near.none()) continue;
-
-                    auto my_id2 = Int4((symmetric?cache_id1:cache_id2)[i2]);
-                    auto i2_vec = Int4(i2);
-
-                    Int4 is_hit = acceptable_id_pair(my_id1,my_id2) & (symmetric 
-                        ? (i1_vec<i2_vec) & near.cast_int()
-                        :                   near.cast_int());
-                    int is_hit_bits = is_hit.movemask();
-
-                    // i2_vec and my_id2 is constant, so we don't have to left pack
-                    // left_pack requires a read, so do before the writes
-
-                    // write out pairs
-                    int n_hit = popcnt_nibble(is_hit_bits);
-                    i1_vec.left_pack(is_hit_bits).store(cache_edge_indices1+ne, Alignment::unaligned);
-                    my_id1.left_pack(is_hit_bits).store(cache_edge_id1     +ne, Alignment::unaligned);
-                    i2_vec                       .store(cache_edge_indices2+ne, Alignment::unaligned);
-                    my_id2                       .store(cache_edge_id2     +ne, Alignment::unaligned);
-                    ne += n_hit;
+            const float* cpos2 = symmetric ? cache_pos1.get() : cache_pos2.get();
+            const bool use_cell_list = float(n_elem1)*float(n_elem2_eff)*(symmetric?0.5f:1.f) >= cell_list_min_pairs;
+            if(use_cell_list) build_cell_list(cpos2, n_elem2_eff);
+
+            cache_block_start.resize(n_block+1);
+            int n_chunk = n_rebuild_chunk(n_block);
+            chunks.resize(std::max(size_t(n_chunk), chunks.size()));
+            if(use_cell_list)
+                for(int nc=0; nc<n_chunk; ++nc) chunks[nc].cell_mask.assign((n_elem2_eff+63)/64, 0u);
+
+            // The first chunk writes directly to the cache (unless it has 16-bit indices) and the
+            // others to their buffers.  A chunk stops once it has more than max_n_edge edges, which
+            // is reported afterwards (the tasks cannot throw).
+            for_each_chunk(n_chunk, n_block, [&](int nc, int b_start, int b_end) {
+                RebuildChunk& ch = chunks[nc];
+                int ne = 0;
+                long n_test = 0;
+                for(int b=b_start; b<b_end && ne<=max_n_edge; ++b) {
+                    int32_t i1 = 4*b;
+                    int32_t i2_start = symmetric?i1+1:0;
+                    int max_block_edges = 4*std::max(n_elem2_eff-i2_start, 0) + 4;
+                    bool direct = !nc && !short_indices;
+                    if(direct) reserve_cache(ne + max_block_edges, ne, max_block_edges);
+                    else       ch.reserve(ne + max_block_edges);
+
+                    int32_t* o_indices1 = direct ? cache_edge_indices1.get() : ch.indices1.data();
+                    int32_t* o_indices2 = direct ? cache_edge_indices2.get() : ch.indices2.data();
+
+                    cache_block_start[b] = ne;
+                    BlockTester<acceptable_id_pair> test_block(*this, i1, cutoff2);
+                    auto test_pair = [&](int32_t i2) {
+                        test_block(i2, o_indices1, o_indices2, ne);
+                    };
+
+                    if(use_cell_list) {
+                        // candidates are visited in increasing order so that the edge list is identical
+                        // to the one from the all-pairs loop
+                        std::vector<uint64_t>& cell_mask = ch.cell_mask;
+                        mark_cell_candidates(cell_mask, cache_pos1+i1*4, i2_start);
+                        for(int w=i2_start>>6; w<int(cell_mask.size()); ++w) {
+                            uint64_t bits = cell_mask[w];
+                            if(!bits) continue;
+                            cell_mask[w] = 0u;
+                            for(; bits; bits &= bits-1) {test_pair(w*64 + __builtin_ctzll(bits)); ++n_test;}
+                        }
+                    } else {
+                        for(int32_t i2=i2_start; i2<n_elem2_eff; ++i2) test_pair(i2);
+                        n_test += std::max(n_elem2_eff-i2_start, 0);
+                    }
                 }
+                ch.n_edge = ne;
+                ch.n_test = n_test;
+            });
+
+            int ne = chunks[0].n_edge;
+            if(ne > max_n_edge) finish_cache(ne);  // throws
+            ne = short_indices ? append_chunks(0, 0, n_chunk, n_block) : append_chunks(ne, 1, n_chunk, n_block);
+            cache_block_start[n_block] = ne;
+            full_rebuild_tests = 0;
+            for(int nc=0; nc<n_chunk; ++nc) full_rebuild_tests += chunks[nc].n_test;
+            last_rebuild_tests = full_rebuild_tests;
+            finish_cache(ne);
+            release_rebuild_buffers();
+            return true;
+        }
+
+        // Recompute the cached pairs of the elements in moved1 and moved2, leaving the rest of the
+        // cache as it is.  Other elements are still within half the buffer of their cached
+        // positions, so the cache remains complete.
+        template<acceptable_id_pair_t acceptable_id_pair>
+        void rebuild_moved(
+                const float* aligned_pos1, const int pos1_stride, int* id1,
+                const float* aligned_pos2, const int pos2_stride, int* id2)
+        {
+            const int n_block = (n_elem1+3)/4;
+            const int n_elem2_eff = symmetric ? n_elem1 : n_elem2;
+            const auto& moved_cols = symmetric ? moved1 : moved2;
+
+            // the positions of a compact cache were already stored
+            for(int i: moved1) {
+                if(!compact) Float4(aligned_pos1+pos1_stride*i).store(cache_pos1+4*i);
+                cache_id1[i] = id1[i];
+            }
+            for(int i: moved2) {
+                if(!compact) Float4(aligned_pos2+pos2_stride*i).store(cache_pos2+4*i);
+                cache_id2[i] = id2[i];
             }
+
+            std::vector<char> dirty_block(n_block, 0);
+            for(int i: moved1) dirty_block[i/4] = 1;
+            moved_col.assign(n_elem2_eff, 0);
+            for(int i: moved_cols) moved_col[i] = 1;
+
+            auto cutoff2 = Float4(sqr(cache_cutoff));
+            int n_chunk = n_rebuild_chunk(n_block);
+            for_each_chunk(n_chunk, n_block, [&](int nc, int b_start, int b_end) {
+                RebuildChunk& ch = chunks[nc];
+                int ne = 0;
+                for(int b=b_start; b<b_end && ne<=max_n_edge; ++b) {
+                    int32_t i1 = 4*b;
+                    int32_t i2_start = symmetric?i1+1:0;
+                    int old_start = cache_block_start[b], old_end = cache_block_start[b+1];
+
+                    // room for the old edges of the block and 4 edges for each new test (with padding
+                    // for the unaligned stores)
+                    ch.reserve(ne + (old_end-old_start) + 4*(dirty_block[b] ? n_elem2_eff : moved_cols.size()) + 4);
+
+                    BlockTester<acceptable_id_pair> test_block(*this, i1, cutoff2);
+                    auto test_pair = [&](int32_t i2) {
+                        test_block(i2, ch.indices1.data(), ch.indices2.data(), ne);
+                    };
+
+                    // cache_block_start[b+1] is read by the previous block, which may be in another
+                    // chunk, so the new starts are kept in the chunk until all chunks are done
+                    ch.block_start.push_back(ne);
+                    if(dirty_block[b]) {
+                        for(int32_t i2=i2_start; i2<n_elem2_eff; ++i2) test_pair(i2);
+                        continue;
+                    }
+
+                    // Merge the new pairs of the moved columns into the old edges of the block, which
+                    // are sorted by second element
+                    size_t c = std::lower_bound(moved_cols.begin(), moved_cols.end(), i2_start) - moved_cols.begin();
+                    for(int e=old_start; e<old_end; ++e) {
+                        int32_t i2 = cached_index2(e);
+                        while(c<moved_cols.size() && moved_cols[c]<=i2) test_pair(moved_cols[c++]);
+                        if(moved_col[i2]) continue;
+                        ch.indices1[ne] = cached_index1(e);
+                        ch.indices2[ne] = i2;
+                        ++ne;
+                    }
+                    while(c<moved_cols.size()) test_pair(moved_cols[c++]);
+                }
+                ch.n_edge = ne;
+            });
+
+            int chunk_size = (n_block+n_chunk-1)/n_chunk;
+            for(int nc=0; nc<n_chunk; ++nc) {
+                RebuildChunk& ch = chunks[nc];
+                if(ch.n_edge > max_n_edge) finish_cache(ch.n_edge);  // throws
+                std::copy(ch.block_start.begin(), ch.block_start.end(), cache_block_start.begin()+nc*chunk_size);
+                ch.block_start.clear();
+            }
+            int ne = append_chunks(0, 0, n_chunk, n_block);
+            cache_block_start[n_block] = ne;
+            finish_cache(ne);
+        }
+
+        void finish_cache(int ne) {
+            if(ne > max_n_edge)
+                throw std::string("pairlist cache has ") + std::to_string(ne) +
+                    " edges, more than the max_n_edge of " + std::to_string(max_n_edge);
             cache_n_edge = ne;
             for(int i=ne; i<round_up(ne,4); ++i) {
                 // we need something sane to fill out the last group of 4 so just duplicate the interactions
                 // with sensitivity 0.
-                cache_edge_indices1[i] = cache_edge_indices1[i-i%4];
-                cache_edge_indices2[i] = cache_edge_indices2[i-i%4]; // just put something sane here
+                if(short_indices) {
+                    cache_edge_short1[i] = cache_edge_short1[i-i%4];
+                    cache_edge_short2[i] = cache_edge_short2[i-i%4];
+                } else {
+                    cache_edge_indices1[i] = cache_edge_indices1[i-i%4];
+                    cache_edge_indices2[i] = cache_edge_indices2[i-i%4]; // just put something sane here
+                }
             }
             cache_valid = true;
             // printf("found %i cache edges\n", cache_n_edge);
         }
 
+        static Int4 accept_all_id_pairs(const Int4& id1, const Int4& id2) {return Int4()==Int4();}
+
+        // Uniform grid over the second set of cached positions, used to find rebuild candidates
+        // without visiting all pairs
+        float cell_size;
+        float cell_reach;  // cache_cutoff in units of cell_size, with a margin for rounding
+        float cell_lo[3];
+        int   cell_n[3];
+        std::vector<int32_t> cell_start;  // element range of each cell in cell_elems
+        std::vector<int32_t> cell_elems;  // element indices sorted by cell, decreasing within a cell
+        std::vector<int32_t> cell_of_elem;
+
+        void build_cell_list(const float* cpos, int n) {
+            // Non-finite positions can never be within the cutoff, so they are left out of the grid.
+            // std::isfinite is not reliable under -ffast-math, so a magnitude test is used instead.
+            auto finite = [](float v) {return std::fabs(v) < 1e30f;};
+            float lo[3] = { 1e30f, 1e30f, 1e30f};
+            float hi[3] = {-1e30f,-1e30f,-1e30f};
+            for(int i=0; i<n; ++i)
+                for(int d=0; d<3; ++d)
+                    if(finite(cpos[i*4+d])) {
+                        lo[d] = std::min(lo[d], cpos[i*4+d]);
+                        hi[d] = std::max(hi[d], cpos[i*4+d]);
+                    }
+
+            // Cells of half the cutoff scan a smaller volume around each block than cells of the full
+            // cutoff.  Cells are enlarged if the grid would be much larger than the number of elements.
+            cell_size = 0.5f*cache_cutoff;
+            for(;;) {
+                float n_cell = 1.f;
+                for(int d=0; d<3; ++d) {
+                    cell_lo[d] = lo[d];
+                    cell_n [d] = hi[d]<lo[d] ? 1 : int(std::min(1e6f, (hi[d]-lo[d])/cell_size)) + 1;
+                    n_cell *= cell_n[d];
+                }
+                if(n_cell <= 2.f*n + 64.f) break;
+                cell_size *= 1.26f;
+            }
+            cell_reach = 1.001f*cache_cutoff/cell_size + 1e-3f;
+
+            cell_start.assign(cell_n[0]*cell_n[1]*cell_n[2]+1, 0);
+            cell_of_elem.resize(n);
+            for(int i=0; i<n; ++i) {
+                int c = -1;
+                if(finite(cpos[i*4+0]) && finite(cpos[i*4+1]) && finite(cpos[i*4+2])) {
+                    int ic[3];
+                    for(int d=0; d<3; ++d)
+                        ic[d] = std::min(cell_n[d]-1, int((cpos[i*4+d]-cell_lo[d])*(1.f/cell_size)));
+                    c = (ic[0]*cell_n[1] + ic[1])*cell_n[2] + ic[2];
+                    ++cell_start[c+1];
+                }
+                cell_of_elem[i] = c;
+            }
+            for(size_t c=1; c<cell_start.size(); ++c) cell_start[c] += cell_start[c-1];
+
+            cell_elems.resize(cell_start.back());
+            for(int i=n-1; i>=0; --i)
+                if(cell_of_elem[i]>=0) cell_elems[cell_start[cell_of_elem[i]]++] = i;
+            // the fill loop advanced each start to the end of its cell
+            for(size_t c=cell_start.size()-1; c>0; --c) cell_start[c] = cell_start[c-1];
+            cell_start[0] = 0;
+        }
+
+        // Mark in cell_mask the elements in the cells within reach of any of the 4 positions at x
+        // (stride 4).  Consecutive elements are usually close together, so the cells are taken
+        // from the bounding box of the 4 positions rather than from each position separately.
+        void mark_cell_candidates(std::vector<uint64_t>& cell_mask, const float* x, int32_t i2_start) const {
+            float f_lo[3] = { 1e30f, 1e30f, 1e30f};
+            float f_hi[3] = {-1e30f,-1e30f,-1e30f};
+            for(int k=0; k<4; ++k) {
+                float f[3];
+                bool inside = true;
+                for(int d=0; d<3; ++d) {
+                    f[d] = (x[k*4+d]-cell_lo[d])*(1.f/cell_size);
+                    // also rejects NaN, since positions beyond the reach of the grid have no neighbors
+                    inside &= f[d] > -cell_reach && f[d] < cell_n[d]+cell_reach;
+                }
+                if(!inside) continue;
+                for(int d=0; d<3; ++d) {
+                    f_lo[d] = std::min(f_lo[d], f[d]);
+                    f_hi[d] = std::max(f_hi[d], f[d]);
+                }
+            }
+            if(f_hi[0] < f_lo[0]) return;
+
+            int c_lo[3], c_hi[3];
+            for(int d=0; d<3; ++d) {
+                c_lo[d] = std::max(int(std::floor(f_lo[d]-cell_reach)), 0);
+                c_hi[d] = std::min(int(std::floor(f_hi[d]+cell_reach)), cell_n[d]-1);
+            }
+
+            for(int a=c_lo[0]; a<=c_hi[0]; ++a)
+                for(int b=c_lo[1]; b<=c_hi[1]; ++b) {
+                    int row = (a*cell_n[1] + b)*cell_n[2];
+                    for(int c=row+c_lo[2]; c<=row+c_hi[2]; ++c) {
+                        // elements are in decreasing order within a cell
+                        for(int i=cell_start[c]; i<cell_start[c+1]; ++i) {
+                            int32_t e = cell_elems[i];
+                            if(e < i2_start) break;
+                            cell_mask[e>>6] |= uint64_t(1)<<(e&63);
+                        }
+                    }
+                }
+        }
+
     public:
-        void change_cache_buffer(float new_buffer) {cache_buffer=new_buffer;}
-        PairlistComputation(int n_elem1_, int n_elem2_, int max_n_edge):
-            n_elem1(n_elem1_), n_elem2(n_elem2_),
+        //! \brief Create an empty cache; if epoch is given, the cache is checked once per value of *epoch
+        PairlistCache(int n_elem1_, int n_elem2_, int max_n_edge_, const uint64_t* epoch_=nullptr):
+            n_elem1(n_elem1_), n_elem2(n_elem2_), max_n_edge(max_n_edge_),
 
-            edge_indices1(new_aligned<int32_t>(max_n_edge, 16)),
-            edge_indices2(new_aligned<int32_t>(max_n_edge, 16)),
-            edge_id1     (new_aligned<int32_t>(max_n_edge, 16)),
-            edge_id2     (new_aligned<int32_t>(max_n_edge, 16)),
+            adaptive_buffer(true),
+            cell_list_min_pairs(CELL_LIST_MIN_PAIRS),
+            n_threads(1),
+            id_filter(nullptr),
 
-            n_edge(0),
+            cutoff(0.f),
+            short_indices(false),
+            cache_n_edge(0),
+            cache_capacity(initial_edge_capacity(n_elem1, n_elem2, max_n_edge)),
+
+            epoch(epoch_),
+            checked_epoch(0u),
 
             cache_valid(false),
-            cache_buffer(1.f), // reasonable value that the user can modify
             cache_pos1(new_aligned<float>(round_up(n_elem1,16)*4,             4)),
             cache_pos2(new_aligned<float>(round_up(symmetric?16:n_elem2,16)*4,4)),
             cache_id1(new_aligned<int32_t>(round_up(n_elem1,16),4)),
             cache_id2(new_aligned<int32_t>(round_up(n_elem2,16),4)),
-            cache_edge_indices1(new_aligned<int32_t>(max_n_edge, 4)),
-            cache_edge_indices2(new_aligned<int32_t>(max_n_edge, 4)),
-            cache_edge_id1     (new_aligned<int32_t>(max_n_edge, 4)),
-            cache_edge_id2     (new_aligned<int32_t>(max_n_edge, 4)),
-            cache_n_edge(0)
+            compact(false),
+            quantum(0.f),
+            full_rebuild_tests(0),
+            last_rebuild_tests(0)
         {
+            for(auto a: {&cache_edge_indices1, &cache_edge_indices2})
+                *a = new_aligned<int32_t>(cache_capacity, 4);
             for(int i=0; i<n_elem1; i+=4)
                 for(int j=0; j<4; ++j) Float4(1e10f).store(cache_pos1+4*(i+j));
             if(!symmetric)
                 for(int i=0; i<n_elem2; i+=4)
                     for(int j=0; j<4; ++j) Float4(1e10f).store(cache_pos2+4*(i+j));
+            change_cache_buffer(1.f);  // reasonable value that the user can modify
+        }
+
+        //! \brief Register a consumer that excludes id pairs by acceptable_id_pair and return its number
+        int add_consumer(acceptable_id_pair_t acceptable_id_pair) {
+            std::lock_guard<std::mutex> lock(mutex);
+            if(consumer_cutoffs.empty()) id_filter = acceptable_id_pair;
+            else if(acceptable_id_pair != id_filter) id_filter = nullptr;
+            cache_valid = false;
+            consumer_cutoffs.push_back(0.f);
+            return consumer_cutoffs.size()-1;
         }
 
+        //! \brief Keep the cache compact (see PairlistCache) or at full precision, starting at the next check
+        void set_compact(bool compact_) {
+            std::lock_guard<std::mutex> lock(mutex);
+            if(compact_ == compact) return;
+            compact = compact_;
+            cache_valid = false;
+
+            // the edge arrays are reallocated in the new format by the full rebuild
+            short_indices = compact && n_elem1 <= 65536 && n_elem2 <= 65536;
+            cache_n_edge = cache_capacity = 0;
+            for(auto a: {&cache_edge_indices1, &cache_edge_indices2}) a->reset();
+            for(auto a: {&cache_edge_short1,   &cache_edge_short2})   a->reset();
+            if(compact) {
+                cache_pos1.reset();
+                cache_pos2.reset();
+            } else {
+                cache_pos1 = new_aligned<float>(round_up(n_elem1,16)*4,              4);
+                cache_pos2 = new_aligned<float>(round_up(symmetric?16:n_elem2,16)*4, 4);
+                std::vector<QuantizedBlock>().swap(qpos1);
+                std::vector<QuantizedBlock>().swap(qpos2);
+            }
+        }
+
+        //! \brief Rebuild the whole cache at the next check, as needed after the elements are renumbered
+        void invalidate() {
+            std::lock_guard<std::mutex> lock(mutex);
+            cache_valid = false;
+        }
+
+        //! \brief Set the cutoff of a consumer (the cache is rebuilt if the largest cutoff changes)
+        void set_cutoff(int consumer, float consumer_cutoff) {
+            std::lock_guard<std::mutex> lock(mutex);
+            consumer_cutoffs.at(consumer) = consumer_cutoff;
+            float new_cutoff = *std::max_element(consumer_cutoffs.begin(), consumer_cutoffs.end());
+            if(new_cutoff != cutoff) {
+                cutoff = new_cutoff;
+                cache_valid = false;
+            }
+        }
+
+        //! \brief Set the buffer beyond the cutoff for cached edges (the starting point if adaptive_buffer)
+        void change_cache_buffer(float new_buffer) {
+            cache_buffer = base_buffer = new_buffer;
+            window = PairlistStats();
+            adapt_step = 1.1f;
+            last_window_cost = 0.;
+        }
+
+        //! \brief Current buffer beyond the cutoff for cached edges
+        float get_cache_buffer() const {return cache_buffer;}
+
+        //! \brief Mean number of validity checks between rebuilds
+        float mean_rebuild_interval() const {return stats.n_rebuild ? float(stats.n_step)/stats.n_rebuild : 0.f;}
+
+        //! \brief Ratio of cached edges examined to edges accepted by the consumers
+        float candidate_ratio() const {return stats.n_accepted>0. ? float(stats.n_candidate/stats.n_accepted) : 0.f;}
+
+        //! \brief Check the cache against the current positions and rebuild it if needed
+        //!
+        //! The positions must be the same for every consumer.  If the cache was already checked
+        //! in the current epoch, the positions are not examined.  acceptable_id_pair is only
+        //! used if it is id_filter.
         template<acceptable_id_pair_t acceptable_id_pair>
-        void find_edges(float cutoff,
-                        const float* aligned_pos1, const int pos1_stride, int* id1, 
-                        const float* aligned_pos2, const int pos2_stride, int* id2) {
-            // Timer timer_total("find_edges");
-            ensure_cache_valid<acceptable_id_pair>(cutoff,
-                    aligned_pos1, pos1_stride, id1,
-                    aligned_pos2, pos2_stride, id2);
-            // Timer timer("pairlist_refine");
+        void ensure_valid(
+                const float* aligned_pos1, const int pos1_stride, int* id1,
+                const float* aligned_pos2, const int pos2_stride, int* id2)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if(epoch && cache_valid && checked_epoch == *epoch) return;
+
+            bool rebuilt = id_filter
+                ? check_and_rebuild<acceptable_id_pair> (aligned_pos1, pos1_stride, id1, aligned_pos2, pos2_stride, id2)
+                : check_and_rebuild<accept_all_id_pairs>(aligned_pos1, pos1_stride, id1, aligned_pos2, pos2_stride, id2);
+            if(epoch) checked_epoch = *epoch;
+
+            // the movement check is not counted, since its cost does not depend on the buffer
+            for(PairlistStats* st: {&stats, &window}) {
+                st->n_step    += 1;
+                st->n_rebuild += rebuilt;
+                if(rebuilt) st->n_test += last_rebuild_tests;
+            }
+        }
+
+        //! \brief Add the refinement work of a consumer to the statistics
+        void record_refine(int n_candidate, int n_accepted) {
+            std::lock_guard<std::mutex> lock(mutex);
+            for(PairlistStats* st: {&stats, &window}) {
+                st->n_candidate += n_candidate;
+                st->n_accepted  += n_accepted;
+            }
+        }
+};
+
+
+//! \brief Key identifying the inputs of a pairlist for sharing caches within an engine
+inline std::vector<int64_t> pairlist_cache_key(bool symmetric, int max_n_edge,
+        const void* node1, const std::vector<index_t>& loc1, const int32_t* id1, int n_elem1,
+        const void* node2, const std::vector<index_t>& loc2, const int32_t* id2, int n_elem2) {
+    std::vector<int64_t> key;
+    key.push_back(symmetric);
+    key.push_back(max_n_edge);
+    key.push_back(int64_t(reinterpret_cast<uintptr_t>(node1)));
+    key.push_back(int64_t(reinterpret_cast<uintptr_t>(node2)));
+    key.push_back(n_elem1);
+    key.push_back(n_elem2);
+    key.insert(key.end(), loc1.begin(), loc1.end());
+    key.insert(key.end(), loc2.begin(), loc2.end());
+    key.insert(key.end(), id1, id1+n_elem1);
+    key.insert(key.end(), id2, id2+n_elem2);
+    return key;
+}
 
-            int ne=0;
-            alignas(16) int32_t offset_v[4] = {0,1,2,3};
-            Int4 offset(offset_v);
+
+template <bool symmetric>
+struct PairlistComputation {
+    public:
+        const int n_elem1, n_elem2;
+        aligned_array<int32_t>  edge_indices1, edge_indices2;  // reallocated as the edge list grows
+        aligned_array<int32_t>  edge_id1,      edge_id2;
+        int n_edge;
+        int edge_capacity;  // allocated length of the edge arrays
+
+        //! \brief Cache of candidate edges, possibly shared with other pairlists
+        std::shared_ptr<PairlistCache<symmetric>> cache;
+
+        //! \brief Edges whose first element is in block b (elements 4b to 4b+3) are
+        //! [edge_block_start[b], edge_block_start[b+1]), filled by find_edges
+        std::vector<int32_t> edge_block_start;
+
+    protected:
+        int max_n_edge;
+        int n_threads;  // number of OpenMP tasks for refinement
+        acceptable_id_pair_t id_rule;
+        int consumer;  // number of this pairlist among the consumers of cache
+        float cutoff;
+
+        // Refine the cached edges [i_start,i_end), which are whole groups of 4, into the edge
+        // arrays starting at ne_start.  At most i_end-i_start edges are written (the stores of
+        // the last group may touch up to i_end), and the number of accepted edges is returned.
+        // The ids of the edges are those passed to find_edges, which the cache has checked.
+        template<bool check_id, acceptable_id_pair_t acceptable_id_pair, typename Index>
+        int refine_range(int i_start, int i_end, int ne_start,
+                    const Index* cache_indices1, const Index* cache_indices2,
+                    const float* aligned_pos1, const int pos1_stride, const int* id1,
+                    const float* aligned_pos2, const int pos2_stride, const int* id2) {
+            const PairlistCache<symmetric>& c = *cache;
+            int ne=ne_start;
             Float4 cutoff2(sqr(cutoff));
 
             int acceptable = 0;
-            for(int i_edge=0; i_edge<cache_n_edge; i_edge+=4) {
-                auto i1 = Int4(cache_edge_indices1+i_edge);
-                auto i2 = Int4(cache_edge_indices2+i_edge);
-                auto eid1 = Int4(cache_edge_id1+i_edge);
-                auto eid2 = Int4(cache_edge_id2+i_edge);
+            for(int i_edge=i_start; i_edge<i_end; i_edge+=4) {
+                auto i1 = load_index4(cache_indices1+i_edge);
+                auto i2 = load_index4(cache_indices2+i_edge);
+                auto eid1 = Int4(id1, i1);
+                auto eid2 = Int4(symmetric?id1:id2, i2);
 
                 Float4 x_diff[4];
                 #pragma unroll
                 for(int j=0; j<4; ++j)
-                    x_diff[j] = 
-                        Float4(aligned_pos1                         +pos1_stride*cache_edge_indices1[i_edge+j]) -
-                        Float4((symmetric?aligned_pos1:aligned_pos2)+pos2_stride*cache_edge_indices2[i_edge+j]);
+                    x_diff[j] =
+                        Float4(aligned_pos1                         +pos1_stride*cache_indices1[i_edge+j]) -
+                        Float4((symmetric?aligned_pos1:aligned_pos2)+pos2_stride*cache_indices2[i_edge+j]);
                 transpose4(x_diff[0],x_diff[1],x_diff[2],x_diff[3]);
                 auto dist2 = sqr(x_diff[0])+sqr(x_diff[1])+sqr(x_diff[2]);
-                    
-                acceptable = (dist2<cutoff2).movemask();
+
+                acceptable = check_id
+                    ? (acceptable_id_pair(eid1,eid2) & (dist2<cutoff2).cast_int()).movemask()
+                    : (dist2<cutoff2).movemask();
 
                 i1  .left_pack_inplace(acceptable);
                 i2  .left_pack_inplace(acceptable);
@@ -244,17 +1111,171 @@ struct PairlistComputation {
                 ne += n_acceptable;
                 // FIXME it would nice to store the transposed positions for later
             }
-            // It is possible that some edges were inappropriately declared acceptable even though
-            // they were outside cache_n_edge due to the padding for SSE of 4.  Let's fix that.
-            int n_extra = round_up(cache_n_edge,4)-cache_n_edge;
-            int invalid_mask = ((1<<4)-1) & ~((1<<(4-n_extra))-1);
-            n_edge = ne-popcnt_nibble(acceptable&invalid_mask);;
+            if(i_end > c.cache_n_edge) {
+                // It is possible that some edges were inappropriately declared acceptable even though
+                // they were outside cache_n_edge due to the padding for SSE of 4.  Let's fix that.
+                int n_extra = i_end-c.cache_n_edge;
+                int invalid_mask = ((1<<4)-1) & ~((1<<(4-n_extra))-1);
+                ne -= popcnt_nibble(acceptable&invalid_mask);
+            }
+            return ne-ne_start;
+        }
+
+        // Chunks of the cache are refined in parallel into their own part of the edge arrays and
+        // then moved together in order, so the edges do not depend on the number of chunks.
+        template<bool check_id, acceptable_id_pair_t acceptable_id_pair, typename Index>
+        void refine(const Index* cache_indices1, const Index* cache_indices2,
+                    const float* aligned_pos1, const int pos1_stride, const int* id1,
+                    const float* aligned_pos2, const int pos2_stride, const int* id2) {
+            const int n_cache_edge = round_up(cache->cache_n_edge,4);
+            const int n_chunk = std::max(1, std::min(n_threads, n_cache_edge/4096));
+
+            if(n_chunk==1) {
+                n_edge = refine_range<check_id,acceptable_id_pair>(0, n_cache_edge, 0, cache_indices1, cache_indices2,
+                        aligned_pos1, pos1_stride, id1, aligned_pos2, pos2_stride, id2);
+            } else {
+                const int chunk_size = round_up((n_cache_edge+n_chunk-1)/n_chunk, 4);
+                std::vector<int> chunk_n_edge(n_chunk);
+                int* chunk_n_edge_ptr = chunk_n_edge.data();  // tasks get a copy of the pointer
+                #pragma omp taskloop grainsize(1)
+                for(int nc=0; nc<n_chunk; ++nc) {
+                    int i_start = nc*chunk_size, i_end = std::min(n_cache_edge, (nc+1)*chunk_size);
+                    chunk_n_edge_ptr[nc] = refine_range<check_id,acceptable_id_pair>(i_start, i_end, i_start,
+                            cache_indices1, cache_indices2,
+                            aligned_pos1, pos1_stride, id1, aligned_pos2, pos2_stride, id2);
+                }
+
+                n_edge = chunk_n_edge[0];
+                for(int nc=1; nc<n_chunk; ++nc) {
+                    for(auto a: {&edge_indices1, &edge_indices2, &edge_id1, &edge_id2})
+                        std::copy_n(a->get()+nc*chunk_size, chunk_n_edge[nc], a->get()+n_edge);
+                    n_edge += chunk_n_edge[nc];
+                }
+            }
 
             for(int i=n_edge; i<round_up(n_edge,4); ++i) {
                 edge_indices1[i] = edge_indices1[i-i%4];
                 edge_indices2[i] = edge_indices2[i-i%4]; // just put something sane here
             }
         }
+
+        // The refined edges are sorted by block of 4 first elements, since they are in the order
+        // of the cache, so the edges of each block are a segment of the edge list.
+        void find_block_starts() {
+            int n_block = (n_elem1+3)/4;
+            edge_block_start.resize(n_block+1);
+            int b = 0;
+            for(int ne=0; ne<n_edge; ++ne)
+                for(int b_edge=edge_indices1[ne]>>2; b<=b_edge; ++b) edge_block_start[b] = ne;
+            for(; b<=n_block; ++b) edge_block_start[b] = n_edge;
+        }
+
+        void ensure_cache() {
+            if(cache) return;
+            cache = std::make_shared<PairlistCache<symmetric>>(n_elem1, n_elem2, max_n_edge);
+            consumer = cache->add_consumer(id_rule);
+        }
+
+    public:
+        //! \brief Pairlist excluding id pairs by acceptable_id_pair
+        //!
+        //! The cache is private unless share_cache is called before the first call to set_cutoff.
+        PairlistComputation(int n_elem1_, int n_elem2_, int max_n_edge_,
+                acceptable_id_pair_t acceptable_id_pair):
+            n_elem1(n_elem1_), n_elem2(n_elem2_),
+
+            edge_indices1(new_aligned<int32_t>(initial_edge_capacity(n_elem1, n_elem2, max_n_edge_), 16)),
+            edge_indices2(new_aligned<int32_t>(initial_edge_capacity(n_elem1, n_elem2, max_n_edge_), 16)),
+            edge_id1     (new_aligned<int32_t>(initial_edge_capacity(n_elem1, n_elem2, max_n_edge_), 16)),
+            edge_id2     (new_aligned<int32_t>(initial_edge_capacity(n_elem1, n_elem2, max_n_edge_), 16)),
+
+            n_edge(0),
+            edge_capacity(initial_edge_capacity(n_elem1, n_elem2, max_n_edge_)),
+            max_n_edge(max_n_edge_),
+            n_threads(1),
+            id_rule(acceptable_id_pair),
+            consumer(-1),
+            cutoff(0.f)
+        {}
+
+        //! \brief Use the cache registered under key in the current PairlistRegistry
+        //!
+        //! The cache is created if no other pairlist has registered it.  The key must identify
+        //! the positions and ids passed to find_edges (see pairlist_cache_key).  If there is no
+        //! current registry (see current_pairlist_registry), the cache is private.
+        void share_cache(const std::vector<int64_t>& key) {
+            if(cache) throw std::string("share_cache must be called before set_cutoff");
+            PairlistRegistry* registry = current_pairlist_registry();
+            if(!registry) return;
+
+            auto& entry = registry->caches[key];
+            cache = std::static_pointer_cast<PairlistCache<symmetric>>(entry.lock());
+            if(!cache) {
+                cache = std::make_shared<PairlistCache<symmetric>>(n_elem1, n_elem2, max_n_edge, &registry->epoch);
+                entry = cache;
+            }
+            consumer = cache->add_consumer(id_rule);
+        }
+
+        //! \brief Set the cutoff for edges
+        void set_cutoff(float cutoff_) {
+            ensure_cache();
+            cutoff = cutoff_;
+            cache->set_cutoff(consumer, cutoff);
+        }
+
+        //! \brief Refine (and rebuild the cache) with up to n_threads OpenMP tasks
+        //!
+        //! The edges are identical for any number of threads.  A shared cache uses the largest
+        //! number of threads of its consumers.
+        void set_n_threads(int n_threads_) {
+            ensure_cache();
+            n_threads = std::max(1, n_threads_);
+            cache->n_threads = std::max(cache->n_threads, n_threads);
+        }
+
+        //! \brief Log the buffer, mean rebuild interval, candidate-to-accepted ratio, and rebuild count of the cache
+        void add_stats_logger(const std::string& name) {
+            if(!logging(LOG_DETAILED)) return;
+            default_logger->add_logger<float>(("pairlist_" + name).c_str(), {4}, [this](float* buffer) {
+                    buffer[0] = cache->get_cache_buffer();
+                    buffer[1] = cache->mean_rebuild_interval();
+                    buffer[2] = cache->candidate_ratio();
+                    buffer[3] = cache->stats.n_rebuild;});
+        }
+
+        template<acceptable_id_pair_t acceptable_id_pair>
+        void find_edges(const float* aligned_pos1, const int pos1_stride, int* id1,
+                        const float* aligned_pos2, const int pos2_stride, int* id2) {
+            // Timer timer_total("find_edges");
+            cache->template ensure_valid<acceptable_id_pair>(
+                    aligned_pos1, pos1_stride, id1,
+                    aligned_pos2, pos2_stride, id2);
+
+            // Timer timer("pairlist_refine");
+
+            // every cached edge may be accepted, and each group of 4 is stored whole
+            int n_needed = round_up(cache->cache_n_edge,4) + 4;
+            if(n_needed > edge_capacity) {
+                edge_capacity = grow_edge_capacity(edge_capacity, n_needed, max_n_edge, 4);
+                for(auto a: {&edge_indices1, &edge_indices2, &edge_id1, &edge_id2})
+                    *a = new_aligned<int32_t>(edge_capacity, 16);
+            }
+            const auto& c = *cache;
+            if(c.short_indices) {
+                if(c.id_filter) refine<false,acceptable_id_pair>(c.cache_edge_short1.get(), c.cache_edge_short2.get(),
+                        aligned_pos1, pos1_stride, id1, aligned_pos2, pos2_stride, id2);
+                else            refine<true, acceptable_id_pair>(c.cache_edge_short1.get(), c.cache_edge_short2.get(),
+                        aligned_pos1, pos1_stride, id1, aligned_pos2, pos2_stride, id2);
+            } else {
+                if(c.id_filter) refine<false,acceptable_id_pair>(c.cache_edge_indices1.get(), c.cache_edge_indices2.get(),
+                        aligned_pos1, pos1_stride, id1, aligned_pos2, pos2_stride, id2);
+                else            refine<true, acceptable_id_pair>(c.cache_edge_indices1.get(), c.cache_edge_indices2.get(),
+                        aligned_pos1, pos1_stride, id1, aligned_pos2, pos2_stride, id2);
+            }
+            find_block_starts();
+            cache->record_refine(cache->cache_n_edge, n_edge);
+        }
 };
 
 
@@ -270,38 +1291,105 @@ struct InteractionGraph{
 
     CoordNode* pos_node1;
     CoordNode* pos_node2;
-    std::vector<index_t> loc1, loc2;
+    std::vector<index_t> loc1, loc2;  // in element order, as are types1, types2, id1, and id2
 
     int   n_elem1, n_elem2;
     int   n_type1, n_type2;
-    int   max_n_edge;
+    int   max_n_edge;     // limit on the number of edges, which defaults to all pairs
     float cutoff;
 
     int n_edge;
+    int edge_capacity;  // allocated length of the per-edge arrays, which grow as needed
 
-    std::unique_ptr<int32_t[]>  types1, types2; // pair type is type[0]*n_types2 + type[1]
-    std::unique_ptr<int32_t[]>  id1,    id2;    // used to avoid self-interaction
+    aligned_array<int32_t>  types1, types2; // pair type is type[0]*n_types2 + type[1]
+    aligned_array<int32_t>  id1,    id2;    // used to avoid self-interaction
 
     // buffers to copy position data to ensure contiguity
-    std::unique_ptr<float[]> pos1, pos2;
+    aligned_array<float> pos1, pos2;
+
+    // If the spatial_sort_interval attribute is set, the elements are stored in the order of a
+    // Morton curve through their positions, which is recomputed on the first call to
+    // compute_edges and then every spatial_sort_interval calls (see sort_spatially).  Storage
+    // position k holds element order1[k], and the pairlist, the edge kernels, and the position
+    // and derivative buffers all work in storage order.  The edge indices for the users of the
+    // graph are mapped back to element numbers, so the order is invisible outside of the graph.
+    // Without sorting, the storage order is the element order.
+    int  spatial_sort_interval;
+    long n_compute;  // calls to compute_edges
+    std::vector<int32_t> order1, order2;
+    std::vector<index_t> stored_loc1, stored_loc2;
+    aligned_array<int32_t> stored_types1, stored_types2;
+    aligned_array<int32_t> stored_id1,    stored_id2;
+    aligned_array<int32_t> mapped_indices1, mapped_indices2;  // edge indices in element order
+    aligned_array<int32_t> mapped_id1,      mapped_id2;       // edge ids in the order of mapped_indices
 
     // per edge data
     PairlistComputation<IType::symmetric> pairlist;
-    int32_t* edge_indices1; // pointers to pairlist-maintained arrays
+    int32_t* edge_indices1; // pointers to pairlist-maintained arrays, or mapped_* if sorted
     int32_t* edge_indices2;  
     int32_t* edge_id1;
     int32_t* edge_id2;
-    std::unique_ptr<float[]>    edge_value;
-    std::unique_ptr<float[]>    edge_deriv;  // this may become a SIMD-type vector
-    std::unique_ptr<float[]>    edge_sensitivity; // must be filled by user of this class
+    aligned_array<float>    edge_value;
+    aligned_array<float>    edge_deriv;  // this may become a SIMD-type vector
+    aligned_array<float>    edge_sensitivity; // must be filled by user of this class
 
-    std::unique_ptr<float[]> interaction_param;
+    aligned_array<float> interaction_param;
 
-    std::unique_ptr<float[]> pos1_deriv, pos2_deriv;
+    aligned_array<float> pos1_deriv, pos2_deriv;
 
     std::vector<Vec<n_param>> edge_param_deriv;
     VecArrayStorage           interaction_param_deriv;
 
+    // When n_threads>1, the edge loops are split into n_threads chunks that are run as OpenMP
+    // tasks.  For the derivatives, each chunk holds whole blocks of 4 first elements (see
+    // PairlistComputation::edge_block_start), so the chunks accumulate into disjoint rows of
+    // pos1_deriv.  Chunk 0 accumulates the second elements directly into pos2_deriv and chunk
+    // nc>0 into its own slice of chunk_deriv.  A symmetric graph accumulates both ends into
+    // pos1_deriv, so there the whole of pos1_deriv goes to the slices.  The slices are reduced
+    // in chunk order, so the result is deterministic for a fixed number of threads.
+    int n_threads;
+    int chunk_deriv_stride;
+    aligned_array<float> chunk_deriv;
+
+    // Optional replacement for compute_edge_range<false,*> that was generated for the parameters
+    // of this graph (see jit_specialize).  set_param discards it.  The element types are passed
+    // at run time, so the kernel survives a change of storage order.
+    typedef void (*jit_kernel_t)(int ne_start, int ne_end, int store_deriv,
+            const int32_t* edge_indices1, const int32_t* edge_indices2,
+            const int32_t* types1, const int32_t* types2,
+            const float* pos1, const float* pos2, float* edge_value, float* edge_deriv);
+    jit_kernel_t jit_kernel;
+
+    // If the reuse_distance attribute is set, an element whose position (its first 3 coordinates)
+    // is within reuse_distance of its reference position, and none of whose other coordinates
+    // changed by more than reuse_direction_change, is placed at its reference position, and
+    // an edge between two such elements keeps its value and derivative from the previous call
+    // instead of being computed again (see compute_moved_edges).  An element that moves further
+    // takes its current position as the new reference.  The energy is then that of positions
+    // each within reuse_distance of the true ones, and when few elements move, few edges are
+    // computed.  This is an approximation: energies and derivatives differ from those of the
+    // true positions, and they depend on the earlier positions of the trajectory, so reuse is off
+    // (reuse_distance 0) unless requested.  For the unit directions of oriented elements,
+    // reuse_direction_change is roughly the largest angle in radians; it must be given if the
+    // elements have more than 3 coordinates.  Only symmetric graphs reuse edges, and not for
+    // parameter derivatives.
+    float reuse_distance;
+    float reuse_direction_change;
+    bool  reuse_valid;      // reference positions and previous edges match the storage order and parameters
+    bool  reuse_has_deriv;  // the previous edges include derivatives
+    aligned_array<float>  ref_pos1;  // laid out as pos1
+    std::vector<uint8_t>  moved1;    // element at storage position k moved on the last call
+    // previous edges whose lower storage position is k are [prev_start[k], prev_start[k+1]),
+    // with derivatives for the lower element first
+    std::vector<int32_t>  prev_start;
+    std::vector<int32_t>  prev_other;  // higher storage position of the edge
+    std::vector<float>    prev_value;
+    std::vector<float>    prev_deriv;  // n_dim1+n_dim2 per edge
+    std::vector<int32_t>  work_edge;   // edges that must be computed
+    aligned_array<int32_t> work_indices1, work_indices2;
+    aligned_array<float>   work_value, work_deriv;
+    int work_capacity;
+
     InteractionGraph(hid_t grp, CoordNode* pos_node1_, CoordNode* pos_node2_ = nullptr):
         pos_node1(pos_node1_), pos_node2(pos_node2_),
 
@@ -312,9 +1400,10 @@ struct InteractionGraph{
         n_type2(h5::get_dset_size(3,grp,"interaction_param")[1]),
 
         max_n_edge(round_up(
-                    h5::read_attribute<int>(grp, ".", "max_n_edge", 
-                        n_elem1*n_elem2/(symmetric?2:1)),
+                    h5::read_attribute<int>(grp, ".", "max_n_edge",
+                        all_pairs_n_edge(n_elem1, n_elem2, symmetric)),
                         16)),
+        edge_capacity(initial_edge_capacity(n_elem1, n_elem2, max_n_edge)),
 
         types1(new_aligned<int32_t>(n_elem1,16)), types2(new_aligned<int32_t>(n_elem2,16)),
         id1   (new_aligned<int32_t>(n_elem1,16)), id2   (new_aligned<int32_t>(n_elem2,16)),
@@ -322,28 +1411,43 @@ struct InteractionGraph{
         pos1(new_aligned<float>(round_up(n_elem1,16)*n_dim1a,             align_bytes)),
         pos2(new_aligned<float>(round_up(symmetric?16:n_elem2,16)*n_dim2a, align_bytes)),
 
-        pairlist(n_elem1,n_elem2,max_n_edge),
+        spatial_sort_interval(h5::read_attribute<int>(grp, ".", "spatial_sort_interval", 0)),
+        n_compute(0),
+        stored_loc1(n_elem1), stored_loc2(symmetric ? 0 : n_elem2),
+        stored_types1(new_aligned<int32_t>(n_elem1,16)), stored_types2(new_aligned<int32_t>(n_elem2,16)),
+        stored_id1   (new_aligned<int32_t>(n_elem1,16)), stored_id2   (new_aligned<int32_t>(n_elem2,16)),
+
+        pairlist(n_elem1,n_elem2,max_n_edge,IType::acceptable_id_pair),
         edge_indices1(pairlist.edge_indices1.get()),
         edge_indices2(pairlist.edge_indices2.get()),
         edge_id1      (pairlist.edge_id1.get()),
         edge_id2      (pairlist.edge_id2.get()),
 
-        edge_value      (new_aligned<float>  (max_n_edge,                 align_bytes)),
-        edge_deriv      (new_aligned<float>  (max_n_edge*(n_dim1+n_dim2), align_bytes)),
-        edge_sensitivity(new_aligned<float>  (max_n_edge,                 align_bytes)),
+        edge_value      (new_aligned<float>  (edge_capacity,                 align_bytes)),
+        edge_deriv      (new_aligned<float>  (edge_capacity*(n_dim1+n_dim2), align_bytes)),
+        edge_sensitivity(new_aligned<float>  (edge_capacity,                 align_bytes)),
 
         interaction_param(new_aligned<float>(n_type1*n_type2*n_param, 4)),
 
         pos1_deriv(new_aligned<float>(round_up(n_elem1,16)*n_dim1a,             maxint(4,simd_width))),
         pos2_deriv(new_aligned<float>(round_up(symmetric?16:n_elem2,16)*n_dim2a, maxint(4,simd_width)))
 
-        ,interaction_param_deriv(n_param, n_type1*n_type2)
+        ,interaction_param_deriv(n_param, n_type1*n_type2),
+
+        n_threads(1),
+        chunk_deriv_stride(symmetric ? round_up(n_elem1,16)*n_dim1a : round_up(n_elem2,16)*n_dim2a),
+        jit_kernel(nullptr),
+        reuse_distance(h5::read_attribute<float>(grp, ".", "reuse_distance", 0.f)),
+        reuse_direction_change(h5::read_attribute<float>(grp, ".", "reuse_direction_change", -1.f)),
+        reuse_valid(false),
+        reuse_has_deriv(false),
+        work_capacity(0)
     {
         using namespace h5;
         auto suffix1 = [](const char* base) {return base + std::string(symmetric?"":"1");};
         bool s = symmetric;
 
-        fill_n(edge_sensitivity, max_n_edge, 0.f);
+        fill_n(edge_sensitivity, edge_capacity, 0.f);
         fill_n(pos1, round_up(n_elem1,16)*n_dim1a, 1e20f); // just put dummy values far from all points
         fill_n(pos2, round_up(symmetric?16:n_elem2,16)*n_dim2a, 1e20f);
         fill_n(pos1_deriv, round_up(n_elem1,16)*n_dim1a, 0.f);
@@ -358,7 +1462,6 @@ struct InteractionGraph{
         check_size(grp, "interaction_param", n_type1, n_type2, n_param);
         traverse_dset<3,float>(grp, "interaction_param", [&](size_t nt1, size_t nt2, size_t np, float x) {
                 interaction_param[(nt1*n_type2+nt2)*n_param+np] = x;});
-        update_cutoffs();
 
         check_size(grp, suffix1("index").c_str(), n_elem1); if(!s) check_size(grp, "index2", n_elem2);
         check_size(grp, suffix1("type").c_str(),  n_elem1); if(!s) check_size(grp, "type2",  n_elem2);
@@ -378,8 +1481,76 @@ struct InteractionGraph{
             for(int nr: range(n_elem2)) types2[nr] = types1[nr];
             for(int nr: range(n_elem2)) id2   [nr] = id1   [nr];
         }
+
+        for(int i=0; i<round_up(n_elem1,16); ++i) stored_id1[i] = 0;
+        for(int i=0; i<round_up(n_elem2,16); ++i) stored_id2[i] = 0;
+        if(spatial_sort_interval) {
+            if(n_dim1<3 || n_dim2<3)
+                throw std::string("spatial_sort_interval requires 3-dimensional positions");
+            for(int i: range(n_elem1)) order1.push_back(i);
+            if(!s) for(int i: range(n_elem2)) order2.push_back(i);
+            reserve_mapped_edges();
+        }
+        store_elements();
+
+        if(reuse_distance > 0.f) {
+            if(!s) throw std::string("reuse_distance requires a symmetric interaction");
+            if(n_dim1>3 && !(reuse_direction_change >= 0.f))
+                throw std::string("reuse_distance requires reuse_direction_change for elements with more than 3 coordinates");
+            ref_pos1 = new_aligned<float>(round_up(n_elem1,16)*n_dim1a, align_bytes);
+            moved1.assign(n_elem1, 1);
+        }
+
+        // the storage order of a sorted graph is its own, and a graph reusing edges finds them
+        // at its reference positions, so their caches cannot be shared
+        if(!spatial_sort_interval && !(reuse_distance > 0.f))
+            pairlist.share_cache(pairlist_cache_key(symmetric, max_n_edge,
+                        pos_node1, loc1, id1.get(), n_elem1,
+                        pos_node2, loc2, id2.get(), s ? 0 : n_elem2));
+        update_cutoffs();
+        // a shared cache is compact if any of the graphs using it asks for it (see PairlistCache)
+        if(read_attribute<int>(grp, ".", "compact_pairlist_cache", 0)) pairlist.cache->set_compact(true);
+        pairlist.add_stats_logger(object_basename(grp));
     }
 
+    // Copy the element data into storage order
+    void store_elements() {
+        const auto& ord2 = symmetric ? order1 : order2;
+        for(int k: range(n_elem1)) {
+            int i = order1.empty() ? k : order1[k];
+            stored_loc1[k] = loc1[i]; stored_types1[k] = types1[i]; stored_id1[k] = id1[i];
+        }
+        for(int k: range(n_elem2)) {
+            int i = ord2.empty() ? k : ord2[k];
+            if(!symmetric) stored_loc2[k] = loc2[i];
+            stored_types2[k] = types2[i]; stored_id2[k] = id2[i];
+        }
+    }
+
+    // Reorder the storage along a Morton curve through the current positions.  The pairlist
+    // cache holds storage positions, so it is rebuilt at the next find_edges.
+    void sort_spatially() {
+        auto sort_order = [](CoordNode* node, const std::vector<index_t>& stored_loc, std::vector<int32_t>& order) {
+            VecArray posv = node->output;
+            int n = order.size();
+            std::vector<float> x(3*n);
+            for(int k: range(n))
+                for(int d: range(3)) x[3*k+d] = posv(d, stored_loc[k]);
+            auto perm = morton_order(x.data(), n);
+            std::vector<int32_t> old_order = order;
+            for(int k: range(n)) order[k] = old_order[perm[k]];
+        };
+        sort_order(pos_node1, stored_loc1, order1);
+        if(!symmetric) sort_order(pos_node2, stored_loc2, order2);
+        store_elements();
+
+        pairlist.cache->invalidate();
+        reuse_valid = false;
+    }
+
+    //! \brief Element number of the first element at storage position k (see edge_block_start)
+    int element1(int k) const {return order1.empty() ? k : order1[k];}
+
     void update_cutoffs() {
         cutoff = 0.f;
         for(int nt1: range(n_type1)) {
@@ -392,9 +1563,17 @@ struct InteractionGraph{
                 }
             }
         }
-        float new_buffer = 1.0f + 0.2f*cutoff;
-        pairlist.change_cache_buffer(new_buffer);
-        // printf("using cache_buffer %.2f for %i %i %i\n", new_buffer, n_dim1, n_dim2, int(symmetric));
+        pairlist.set_cutoff(cutoff);
+        // the buffer is for the largest cutoff of any pairlist sharing the cache
+        pairlist.cache->change_cache_buffer(1.0f + 0.2f*pairlist.cache->cutoff);
+    }
+
+    void set_n_threads(int n_threads_) {
+        n_threads = std::max(1,n_threads_);
+        pairlist.set_n_threads(n_threads);
+        chunk_deriv = n_threads>1
+            ? new_aligned<float>((n_threads-1)*chunk_deriv_stride, maxint(4,simd_width))
+            : aligned_array<float>();
     }
 
     std::vector<float> get_param() const {
@@ -422,6 +1601,63 @@ struct InteractionGraph{
                 std::to_string(IType::n_param)+")";
         std::copy(begin(new_param), end(new_param), interaction_param.get());
         update_cutoffs();
+        jit_kernel = nullptr;  // the parameters are compiled into the kernel
+        reuse_valid = false;
+    }
+
+    // Generate compute_edge_range with the interaction parameters of this graph as compile-time
+    // constants, then compile and load it.  The source depends only on the parameters and not on
+    // the elements or their storage order.  IType must provide jit_header() and jit_name() so
+    // that the generated code can refer to it.
+    void jit_specialize(const std::string& cache_dir) {
+        std::ostringstream src;
+        auto emit_table = [&](const char* decl, int n, std::function<std::string(int)> value) {
+            src << "alignas(16) const " << decl << "[" << std::max(n,1) << "] = {";
+            for(int i: range(n)) src << (i%8 ? " " : "\n    ") << value(i) << ",";
+            src << "};\n";
+        };
+
+        src << "// Kernel generated by InteractionGraph::jit_specialize\n"
+            << "#include \"" << IType::jit_header() << "\"\n\n"
+            << "namespace {\n"
+            << "typedef " << IType::jit_name() << " IType;\n"
+            << "static_assert(IType::n_param==" << n_param << " && IType::symmetric==" << symmetric
+            <<    ", \"IType does not match the engine\");\n"
+            << "constexpr int n_dim1 = " << n_dim1 << ", n_dim1a = " << n_dim1a << ";\n"
+            << "constexpr int n_dim2 = " << n_dim2 << ", n_dim2a = " << n_dim2a << ";\n"
+            << "constexpr int n_type2 = " << n_type2 << ", n_param = " << n_param << ";\n";
+
+        emit_table("float interaction_param", n_type1*n_type2*n_param, [&](int i) {
+                return jit_float_literal(interaction_param[i]);});
+
+        src << "}\n\n"
+            << "extern \"C\" void upside_jit_compute_edges(int ne_start, int ne_end, int store_deriv,\n"
+            << "        const int32_t* edge_indices1, const int32_t* edge_indices2,\n"
+            << "        const int32_t* types1, const int32_t* types2,\n"
+            << "        const float* pos1, const float* pos2, float* edge_value, float* edge_deriv) {\n"
+            << "    for(int ne=ne_start; ne<ne_end; ne+=4) {\n"
+            << "        auto i1 = Int4(edge_indices1+ne);\n"
+            << "        auto i2 = Int4(edge_indices2+ne);\n"
+            << "        auto interaction_offset = (Int4(types1,i1)*Int4(n_type2) + Int4(types2,i2))*Int4(n_param);\n"
+            << "        const float* interaction_ptr[4] = {\n"
+            << "            interaction_param+interaction_offset.x(),\n"
+            << "            interaction_param+interaction_offset.y(),\n"
+            << "            interaction_param+interaction_offset.z(),\n"
+            << "            interaction_param+interaction_offset.w()};\n"
+            << "        auto coord1 = aligned_gather_vec<n_dim1>(pos1, i1*Int4(n_dim1a));\n"
+            << "        auto coord2 = aligned_gather_vec<n_dim2>(pos2, i2*Int4(n_dim2a));\n"
+            << "        Vec<n_dim1,Float4> d1;\n"
+            << "        Vec<n_dim2,Float4> d2;\n"
+            << "        IType::compute_edge(d1,d2, interaction_ptr, coord1,coord2).store(edge_value+ne);\n"
+            << "        if(store_deriv) {\n"
+            << "            store_vec(edge_deriv + ne*(n_dim1+n_dim2),          d1);\n"
+            << "            store_vec(edge_deriv + ne*(n_dim1+n_dim2)+4*n_dim1, d2);\n"
+            << "        }\n"
+            << "    }\n"
+            << "}\n";
+
+        jit_kernel = reinterpret_cast<jit_kernel_t>(
+                jit_load_symbol(cache_dir, src.str(), "upside_jit_compute_edges"));
     }
 
     std::vector<float> count_edges_by_type() {
@@ -440,26 +1676,58 @@ struct InteractionGraph{
         return retval;
     }
 
+    // If store_deriv is false, only edge_value is computed and propagate_derivatives must not
+    // be called until compute_edges is called again with store_deriv true.
     template<bool param_deriv=false>
-    void compute_edges() {
+    void compute_edges(bool store_deriv=true) {
+        if(spatial_sort_interval && n_compute%spatial_sort_interval == 0) sort_spatially();
+        ++n_compute;
+        bool reuse = reuse_distance > 0.f && !param_deriv;
+
         // Copy in the data to packed arrays to ensure contiguity
         {
             VecArray posv = pos_node1->output;
-            for(int ne=0; ne<n_elem1; ++ne) 
-                store_vec(pos1.get()+ne*n_dim1a, load_vec<n_dim1>(posv, loc1[ne]));
+            for(int ne=0; ne<n_elem1; ++ne) {
+                auto p = load_vec<n_dim1>(posv, stored_loc1[ne]);
+                store_vec(pos1.get()+ne*n_dim1a, reuse ? reference_position(ne, p) : p);
+            }
         }
         if(!symmetric) {
             VecArray posv = pos_node2->output;
             for(int ne=0; ne<n_elem2; ++ne) 
-                store_vec(pos2.get()+ne*n_dim2a, load_vec<n_dim2>(posv, loc2[ne]));
+                store_vec(pos2.get()+ne*n_dim2a, load_vec<n_dim2>(posv, stored_loc2[ne]));
         }
 
         // First find all the edges
         {
-            pairlist.template find_edges<IType::acceptable_id_pair>(cutoff,
-                                pos1.get(), n_dim1a, id1.get(),
-                                (symmetric?pos1:pos2).get(), n_dim2a, (symmetric?id1:id2).get());
+            pairlist.template find_edges<IType::acceptable_id_pair>(
+                                pos1.get(), n_dim1a, stored_id1.get(),
+                                (symmetric?pos1:pos2).get(), n_dim2a, (symmetric?stored_id1:stored_id2).get());
             n_edge = pairlist.n_edge;
+
+            // the pairlist may have reallocated its arrays
+            edge_indices1 = pairlist.edge_indices1.get();
+            edge_indices2 = pairlist.edge_indices2.get();
+            edge_id1      = pairlist.edge_id1.get();
+            edge_id2      = pairlist.edge_id2.get();
+            reserve_edges(round_up(n_edge,4));
+
+            // Users of a symmetric graph may rely on the first element of each edge being the
+            // lower-numbered one, as it is without sorting.
+            if(spatial_sort_interval) {
+                const auto& ord2 = symmetric ? order1 : order2;
+                for(int ne=0; ne<round_up(n_edge,4); ++ne) {
+                    int32_t i1 = order1[edge_indices1[ne]];
+                    int32_t i2 = ord2  [edge_indices2[ne]];
+                    if(symmetric && i2<i1) std::swap(i1,i2);
+                    mapped_indices1[ne] = i1;  mapped_id1[ne] = id1[i1];
+                    mapped_indices2[ne] = i2;  mapped_id2[ne] = (symmetric?id1:id2)[i2];
+                }
+                edge_indices1 = mapped_indices1.get();
+                edge_indices2 = mapped_indices2.get();
+                edge_id1      = mapped_id1.get();
+                edge_id2      = mapped_id2.get();
+            }
         }
         // printf("n_edge for n_dim1 %i n_dim2 %i n_elem1 %i n_elem2 %i is %i\n", n_dim1, n_dim2, n_elem1, n_elem2, n_edge);
 
@@ -467,12 +1735,188 @@ struct InteractionGraph{
         if(param_deriv)
             edge_param_deriv.clear();
 
-        for(int ne=0; ne<n_edge; ne+=4) {
-            auto i1 = Int4(edge_indices1+ne);
-            auto i2 = Int4(edge_indices2+ne);
+        if(reuse && reuse_valid && (reuse_has_deriv || !store_deriv)) {
+            compute_moved_edges(store_deriv);
+        } else if(n_threads>1 && !param_deriv) {
+            int chunk_size = edge_chunk_size();
+            #pragma omp taskloop grainsize(1)
+            for(int nc=0; nc<n_threads; ++nc) {
+                int ne_start = nc*chunk_size, ne_end = std::min(n_edge, (nc+1)*chunk_size);
+                if(store_deriv) compute_edge_range<false,true >(ne_start, ne_end);
+                else            compute_edge_range<false,false>(ne_start, ne_end);
+            }
+        } else if(store_deriv || param_deriv) {
+            compute_edge_range<param_deriv,true>(0, n_edge);
+        } else {
+            compute_edge_range<false,false>(0, n_edge);
+        }
+
+        if(reuse) save_edges(store_deriv);
+    }
+
+    // Position of the element at storage position k given its current position p, which is the
+    // reference position unless the element moved further than reuse_distance from it or its
+    // other coordinates changed by more than reuse_direction_change
+    Vec<n_dim1> reference_position(int k, const Vec<n_dim1>& p) {
+        float* ref = ref_pos1.get()+k*n_dim1a;
+        float dist2 = 0.f;
+        for(int d: range(std::min(n_dim1,3))) dist2 += sqr(p[d]-ref[d]);
+        float dev = 0.f;
+        for(int d: range(3,n_dim1)) dev = std::max(dev, fabsf(p[d]-ref[d]));
+        moved1[k] = !reuse_valid || !(dist2 <= sqr(reuse_distance)) || (n_dim1>3 && !(dev <= reuse_direction_change));
+        if(moved1[k]) store_vec(ref, p);
+        return load_vec<n_dim1>(ref);
+    }
+
+    // Previous edge between storage positions i1 and i2, or -1 if there was none
+    int previous_edge(int i1, int i2) const {
+        if(i1>i2) std::swap(i1,i2);
+        for(int pe=prev_start[i1]; pe<prev_start[i1+1]; ++pe)
+            if(prev_other[pe]==i2) return pe;
+        return -1;
+    }
 
-            auto t1 = Int4(types1.get(),i1);
-            auto t2 = Int4(types2.get(),i2);
+    // Copy the previous value and derivative of each edge between two elements that did not
+    // move, and compute the other edges from a packed list of their indices
+    void compute_moved_edges(bool store_deriv) {
+        constexpr int n_dim = n_dim1+n_dim2;
+        const int32_t* indices1 = pairlist.edge_indices1.get();
+        const int32_t* indices2 = pairlist.edge_indices2.get();
+
+        work_edge.clear();
+        for(int ne=0; ne<n_edge; ++ne) {
+            int i1 = indices1[ne], i2 = indices2[ne];
+            int pe = moved1[i1] || moved1[i2] ? -1 : previous_edge(i1,i2);
+            if(pe<0) {work_edge.push_back(ne); continue;}
+
+            edge_value[ne] = prev_value[pe];
+            if(store_deriv) {
+                // derivative component j of edge ne is at d[4*j] (see compute_edge_range)
+                float* d = edge_deriv + (ne&~3)*n_dim + (ne&3);
+                for(int j: range(n_dim)) d[4*j] = prev_deriv[pe*n_dim + (i1>i2 ? (j+n_dim1)%n_dim : j)];
+            }
+        }
+        // the padding edges are never copied, so they must not hold stale values
+        for(int ne=n_edge; ne<round_up(n_edge,4); ++ne) {
+            edge_value[ne] = 0.f;
+            if(store_deriv)
+                for(int j: range(n_dim)) edge_deriv[(ne&~3)*n_dim + 4*j + (ne&3)] = 0.f;
+        }
+
+        int n_work = work_edge.size();
+        if(!n_work) return;
+        if(round_up(n_work,4) > work_capacity) {
+            work_capacity = round_up(n_work + n_work/2, 16);
+            work_indices1 = new_aligned<int32_t>(work_capacity,                 16);
+            work_indices2 = new_aligned<int32_t>(work_capacity,                 16);
+            work_value    = new_aligned<float>  (work_capacity,                 align_bytes);
+            work_deriv    = new_aligned<float>  (work_capacity*(n_dim1+n_dim2), align_bytes);
+        }
+        for(int k=0; k<round_up(n_work,4); ++k) {
+            int ne = work_edge[k<n_work ? k : 0];  // the padding repeats the first edge
+            work_indices1[k] = indices1[ne];
+            work_indices2[k] = indices2[ne];
+        }
+
+        auto compute_work = [&](int k_start, int k_end) {
+            if(store_deriv) compute_edge_range<false,true >(k_start, k_end,
+                    work_indices1.get(), work_indices2.get(), work_value.get(), work_deriv.get());
+            else            compute_edge_range<false,false>(k_start, k_end,
+                    work_indices1.get(), work_indices2.get(), work_value.get(), work_deriv.get());
+        };
+        if(n_threads>1) {
+            int chunk_size = round_up((n_work+n_threads-1)/n_threads, 4);
+            #pragma omp taskloop grainsize(1)
+            for(int nc=0; nc<n_threads; ++nc)
+                compute_work(nc*chunk_size, std::min(n_work, (nc+1)*chunk_size));
+        } else {
+            compute_work(0, n_work);
+        }
+
+        for(int k: range(n_work)) {
+            int ne = work_edge[k];
+            edge_value[ne] = work_value[k];
+            if(store_deriv)
+                for(int j: range(n_dim))
+                    edge_deriv[(ne&~3)*n_dim + 4*j + (ne&3)] = work_deriv[(k&~3)*n_dim + 4*j + (k&3)];
+        }
+    }
+
+    // Record the edges of this call for compute_moved_edges
+    void save_edges(bool store_deriv) {
+        constexpr int n_dim = n_dim1+n_dim2;
+        const int32_t* indices1 = pairlist.edge_indices1.get();
+        const int32_t* indices2 = pairlist.edge_indices2.get();
+
+        prev_start.assign(n_elem1+1, 0);
+        for(int ne=0; ne<n_edge; ++ne) prev_start[std::min(indices1[ne],indices2[ne])+1]++;
+        for(int k: range(n_elem1)) prev_start[k+1] += prev_start[k];
+
+        prev_other.resize(n_edge);
+        prev_value.resize(n_edge);
+        prev_deriv.resize(store_deriv ? n_edge*n_dim : 0);
+        std::vector<int32_t> next(prev_start.begin(), prev_start.end()-1);
+        for(int ne=0; ne<n_edge; ++ne) {
+            int i1 = indices1[ne], i2 = indices2[ne];
+            int pe = next[std::min(i1,i2)]++;
+            prev_other[pe] = std::max(i1,i2);
+            prev_value[pe] = edge_value[ne];
+            if(store_deriv) {
+                const float* d = edge_deriv + (ne&~3)*n_dim + (ne&3);
+                for(int j: range(n_dim)) prev_deriv[pe*n_dim + (i1>i2 ? (j+n_dim1)%n_dim : j)] = d[4*j];
+            }
+        }
+        reuse_has_deriv = store_deriv;
+        reuse_valid = true;
+    }
+
+    // Grow the per-edge arrays to hold n_needed edges.  Their contents are recomputed on every
+    // step, so only edge_sensitivity needs to be initialized.
+    void reserve_edges(int n_needed) {
+        if(n_needed <= edge_capacity) return;
+        edge_capacity = grow_edge_capacity(edge_capacity, n_needed, round_up(max_n_edge,4));
+        edge_value       = new_aligned<float>(edge_capacity,                 align_bytes);
+        edge_deriv       = new_aligned<float>(edge_capacity*(n_dim1+n_dim2), align_bytes);
+        edge_sensitivity = new_aligned<float>(edge_capacity,                 align_bytes);
+        fill_n(edge_sensitivity, edge_capacity, 0.f);
+        if(spatial_sort_interval) reserve_mapped_edges();
+    }
+
+    void reserve_mapped_edges() {
+        for(auto a: {&mapped_indices1, &mapped_indices2, &mapped_id1, &mapped_id2})
+            *a = new_aligned<int32_t>(edge_capacity, 16);
+    }
+
+    // Number of edges per chunk for parallel execution (multiple of 4 so that no SIMD group is split)
+    int edge_chunk_size() const {
+        return round_up((n_edge+n_threads-1)/n_threads, 4);
+    }
+
+    template<bool param_deriv, bool store_deriv>
+    void compute_edge_range(int ne_start, int ne_end) {
+        compute_edge_range<param_deriv,store_deriv>(ne_start, ne_end,
+                pairlist.edge_indices1.get(), pairlist.edge_indices2.get(), edge_value.get(), edge_deriv.get());
+    }
+
+    // Compute the edges between storage positions indices1[ne] and indices2[ne] into value and
+    // deriv, for ne in [ne_start,ne_end) rounded up to a multiple of 4
+    template<bool param_deriv, bool store_deriv>
+    void compute_edge_range(int ne_start, int ne_end,
+            const int32_t* indices1, const int32_t* indices2, float* value, float* deriv) {
+        if(!param_deriv && jit_kernel) {
+            jit_kernel(ne_start, ne_end, store_deriv, indices1, indices2,
+                    stored_types1.get(), stored_types2.get(),
+                    pos1.get(), (symmetric?pos1:pos2).get(), value, deriv);
+            return;
+        }
+
+        // storage positions, as are all indices below
+        for(int ne=ne_start; ne<ne_end; ne+=4) {
+            auto i1 = Int4(indices1+ne);
+            auto i2 = Int4(indices2+ne);
+
+            auto t1 = Int4(stored_types1.get(),i1);
+            auto t2 = Int4(stored_types2.get(),i2);
 
             auto interaction_offset = (t1*Int4(n_type2) + t2)*Int4(n_param);
             const float* interaction_ptr[4] = {
@@ -487,9 +1931,11 @@ struct InteractionGraph{
             Vec<n_dim1,Float4> d1;
             Vec<n_dim2,Float4> d2;
 
-            IType::compute_edge(d1,d2, interaction_ptr, coord1,coord2).store(edge_value+ne);
-            store_vec(edge_deriv + ne*(n_dim1+n_dim2),          d1);
-            store_vec(edge_deriv + ne*(n_dim1+n_dim2)+4*n_dim1, d2);
+            IType::compute_edge(d1,d2, interaction_ptr, coord1,coord2).store(value+ne);
+            if(store_deriv) {
+                store_vec(deriv + ne*(n_dim1+n_dim2),          d1);
+                store_vec(deriv + ne*(n_dim1+n_dim2)+4*n_dim1, d2);
+            }
 
             if(param_deriv) {
                 for(int i: range(4)) {
@@ -515,43 +1961,108 @@ struct InteractionGraph{
         // zero ourselves.
         for(int ne=n_edge; ne<round_up(n_edge,4); ++ne) edge_sensitivity[ne] = 0.f;
 
-        // Zero accumulation buffers
-        fill_n(pos1_deriv, n_elem1*n_dim1a, 0.f);
-        if(!symmetric) fill_n(pos2_deriv, n_elem2*n_dim2a, 0.f);
-        if(param_deriv)
-            fill(interaction_param_deriv, 0.f);
-
-        // Accumulate derivatives
-        for(int ne=0; ne<n_edge; ne+=4) {
-            auto i1 = Int4(edge_indices1+ne);
-            auto i2 = Int4(edge_indices2+ne);
-            auto sens = Float4(edge_sensitivity+ne);
-
-            auto d1 = sens*load_vec<n_dim1>(edge_deriv + ne*(n_dim1+n_dim2), Alignment::aligned);
-            auto d2 = sens*load_vec<n_dim2>(edge_deriv + ne*(n_dim1+n_dim2)+4*n_dim1, Alignment::aligned);
-
-            aligned_scatter_update_vec_destructive(pos1_deriv.get(),                       i1*Int4(n_dim1a), d1);
-            aligned_scatter_update_vec_destructive((symmetric?pos1_deriv:pos2_deriv).get(),i2*Int4(n_dim2a), d2);
+        if(n_threads>1 && !param_deriv) {
+            int size1 = n_elem1*n_dim1a;
+            int size2 = symmetric ? 0 : n_elem2*n_dim2a;
+
+            // Split at block boundaries into chunks of about the same number of edges
+            const int32_t* block_start = pairlist.edge_block_start.data();
+            int n_block = pairlist.edge_block_start.size()-1;
+            std::vector<int> chunk_block(n_threads+1, n_block);
+            for(int nc=0; nc<n_threads; ++nc)
+                chunk_block[nc] = std::lower_bound(block_start, block_start+n_block,
+                        int(int64_t(n_edge)*nc/n_threads)) - block_start;
+            const int* chunk_block_ptr = chunk_block.data();
+
+            if(!symmetric) fill_n(pos1_deriv, size1, 0.f);
+            #pragma omp taskloop grainsize(1)
+            for(int nc=0; nc<n_threads; ++nc) {
+                float* chunk = nc ? chunk_deriv+(nc-1)*chunk_deriv_stride : nullptr;
+                float* d1 = symmetric && nc ? chunk : pos1_deriv.get();
+                float* d2 = symmetric ? d1 : (nc ? chunk : pos2_deriv.get());
+                if(symmetric) std::fill_n(d1, size1, 0.f);
+                std::fill_n(d2, size2, 0.f);
+
+                int b_start = chunk_block_ptr[nc], b_end = chunk_block_ptr[nc+1];
+                accumulate_edge_range<false>(block_start[b_start], block_start[b_end], d1, d2);
+            }
 
-            if(param_deriv) {
-                for(int i: range(4)) {
-                    int t1 = types1[edge_indices1[ne+i]];
-                    int t2 = types2[edge_indices2[ne+i]];
-                    update_vec(interaction_param_deriv, t1*n_type2+t2, extract_float(sens,i)*edge_param_deriv[ne+i]);
+            // Reduce the chunks in a fixed order over blocks of the accumulation buffers
+            float* target = (symmetric?pos1_deriv:pos2_deriv).get();
+            int size = symmetric ? size1 : size2;
+            const int block = 1024;
+            #pragma omp taskloop grainsize(1)
+            for(int i_start=0; i_start<size; i_start+=block) {
+                int i_end = std::min(size, i_start+block);
+                for(int nc=1; nc<n_threads; ++nc) {
+                    const float* chunk = chunk_deriv+(nc-1)*chunk_deriv_stride;
+                    for(int i=i_start; i<i_end; ++i)
+                        target[i] += chunk[i];
                 }
             }
+        } else {
+            // Zero accumulation buffers
+            fill_n(pos1_deriv, n_elem1*n_dim1a, 0.f);
+            if(!symmetric) fill_n(pos2_deriv, n_elem2*n_dim2a, 0.f);
+            if(param_deriv)
+                fill(interaction_param_deriv, 0.f);
+
+            accumulate_edge_range<param_deriv>(0, n_edge,
+                    pos1_deriv.get(), (symmetric?pos1_deriv:pos2_deriv).get());
         }
 
         // Push derivatives to slots
         {
             VecArray pos1_sens = pos_node1->sens;
             for(int i1=0; i1<n_elem1; ++i1)
-                update_vec(pos1_sens, loc1[i1], load_vec<n_dim1>(pos1_deriv+i1*n_dim1a));
+                update_vec(pos1_sens, stored_loc1[i1], load_vec<n_dim1>(pos1_deriv+i1*n_dim1a));
         }
         if(!symmetric) {
             VecArray pos2_sens = pos_node2->sens;
             for(int i2=0; i2<n_elem2; ++i2)
-                update_vec(pos2_sens, loc2[i2], load_vec<n_dim2>(pos2_deriv+i2*n_dim2a));
+                update_vec(pos2_sens, stored_loc2[i2], load_vec<n_dim2>(pos2_deriv+i2*n_dim2a));
+        }
+    }
+
+    void accumulate_edge(int ne, float* deriv1, float* deriv2) {
+        float sens = edge_sensitivity[ne];
+        const float* d = edge_deriv + (ne&~3)*(n_dim1+n_dim2) + (ne&3);
+        float* p1 = deriv1 + pairlist.edge_indices1[ne]*n_dim1a;
+        float* p2 = deriv2 + pairlist.edge_indices2[ne]*n_dim2a;
+        for(int i: range(n_dim1)) p1[i] += sens*d[4*i];
+        for(int i: range(n_dim2)) p2[i] += sens*d[4*(n_dim1+i)];
+    }
+
+    // The range need not start or end on a group of 4 edges.  The partial groups at its ends
+    // are accumulated one edge at a time, so that no other edges are touched.  The padding
+    // after n_edge has zero sensitivity, so the last group of the edge list is done whole.
+    template<bool param_deriv>
+    void accumulate_edge_range(int ne_start, int ne_end, float* deriv1, float* deriv2) {
+        int ne_vec_start = std::min(round_up(ne_start,4), ne_end);
+        int ne_vec_end   = ne_end==n_edge ? ne_end : std::max(ne_vec_start, ne_end&~3);
+        for(int ne=ne_start;   ne<ne_vec_start; ++ne) accumulate_edge(ne, deriv1, deriv2);
+        for(int ne=ne_vec_end; ne<ne_end;       ++ne) accumulate_edge(ne, deriv1, deriv2);
+
+        const int32_t* indices1 = pairlist.edge_indices1.get();
+        const int32_t* indices2 = pairlist.edge_indices2.get();
+        for(int ne=ne_vec_start; ne<ne_vec_end; ne+=4) {
+            auto i1 = Int4(indices1+ne);
+            auto i2 = Int4(indices2+ne);
+            auto sens = Float4(edge_sensitivity+ne);
+
+            auto d1 = sens*load_vec<n_dim1>(edge_deriv + ne*(n_dim1+n_dim2), Alignment::aligned);
+            auto d2 = sens*load_vec<n_dim2>(edge_deriv + ne*(n_dim1+n_dim2)+4*n_dim1, Alignment::aligned);
+
+            aligned_scatter_update_vec_destructive(deriv1, i1*Int4(n_dim1a), d1);
+            aligned_scatter_update_vec_destructive(deriv2, i2*Int4(n_dim2a), d2);
+
+            if(param_deriv) {
+                for(int i: range(4)) {
+                    int t1 = stored_types1[indices1[ne+i]];
+                    int t2 = stored_types2[indices2[ne+i]];
+                    update_vec(interaction_param_deriv, t1*n_type2+t2, extract_float(sens,i)*edge_param_deriv[ne+i]);
+                }
+            }
         }
     }
 };
@@ -0,0 +1,104 @@
+#include "jit.h"
+#include <dlfcn.h>
+#include <unistd.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <map>
+#include <cstring>
+#include <atomic>
+
+using namespace std;
+
+#ifndef UPSIDE_JIT_CXX
+#define UPSIDE_JIT_CXX "c++"
+#endif
+#ifndef UPSIDE_JIT_FLAGS
+#define UPSIDE_JIT_FLAGS "-O3 -std=c++11"
+#endif
+
+static uint64_t fnv1a_hash(const string& s) {
+    uint64_t h = 14695981039346656037ull;
+    for(unsigned char c: s) {h ^= c; h *= 1099511628211ull;}
+    return h;
+}
+
+// single-quote a path for the shell so that spaces and metacharacters are taken literally
+static string shell_quote(const string& s) {
+    string quoted = "'";
+    for(char c: s) {
+        if(c=='\'') quoted += "'\\''";
+        else quoted += c;
+    }
+    return quoted + "'";
+}
+
+static bool file_exists(const string& path) {
+    return access(path.c_str(), F_OK) == 0;
+}
+
+string jit_float_literal(float x) {
+    // The engine may be built with -ffast-math, under which std::isnan and std::isinf can be
+    // folded to false, so the exponent bits are tested directly
+    uint32_t bits;
+    memcpy(&bits, &x, sizeof(bits));
+    if((bits & 0x7f800000u) == 0x7f800000u) {
+        if(bits & 0x007fffffu) return "__builtin_nanf(\"\")";
+        return (bits & 0x80000000u) ? "(-__builtin_inff())" : "__builtin_inff()";
+    }
+    char buffer[32];
+    snprintf(buffer, sizeof(buffer), "%.8ef", x);  // 9 significant digits round-trip a float
+    return buffer;
+}
+
+void* jit_load_symbol(const string& cache_dir, const string& source, const string& symbol) {
+    const char* env_cxx = getenv("UPSIDE_JIT_CXX");
+    string command_prefix = string(env_cxx ? env_cxx : UPSIDE_JIT_CXX) + " " + UPSIDE_JIT_FLAGS +
+        " -shared -fPIC";
+
+    char key[32];
+    snprintf(key, sizeof(key), "%016llx", (unsigned long long)fnv1a_hash(command_prefix + "\n" + source));
+    string base = cache_dir + "/upside_jit_" + key;
+    string so_path = base + ".so";
+
+    // shared objects are never unloaded, so each one is opened once per process
+    static map<string,void*> handles;
+    void* handle = nullptr;
+
+    #pragma omp critical (jit_load)
+    {
+        auto it = handles.find(so_path);
+        if(it != handles.end()) handle = it->second;
+    }
+
+    if(!handle) {
+        if(!file_exists(so_path)) {
+            // write and compile under process-specific names then rename, so that concurrent runs
+            // (or threads) never compile a partially written source or load a partially written shared object
+            static atomic<int> n_compile(0);
+            string suffix = ".tmp" + to_string(getpid()) + "_" + to_string(n_compile++);
+            string tmp_cpp_path = base + suffix + ".cpp";
+            string tmp_so_path  = base + suffix + ".so";
+            FILE* f = fopen(tmp_cpp_path.c_str(), "w");
+            if(!f) throw string("unable to write JIT source to ") + tmp_cpp_path;
+            bool written = fwrite(source.data(), 1, source.size(), f) == source.size();
+            if(fclose(f) || !written) throw string("unable to write JIT source to ") + tmp_cpp_path;
+
+            string command = command_prefix + " -o " + shell_quote(tmp_so_path) + " " + shell_quote(tmp_cpp_path);
+            if(system(command.c_str()) || rename(tmp_so_path.c_str(), so_path.c_str()))
+                throw string("JIT compilation failed: ") + command;
+            // the source is kept beside the kernel for inspection
+            rename(tmp_cpp_path.c_str(), (base + ".cpp").c_str());
+        }
+
+        handle = dlopen(so_path.c_str(), RTLD_NOW|RTLD_LOCAL);
+        if(!handle) throw string("unable to load JIT kernel ") + so_path + ": " + dlerror();
+
+        #pragma omp critical (jit_load)
+        handles[so_path] = handle;
+    }
+
+    void* sym = dlsym(handle, symbol.c_str());
+    if(!sym) throw string("JIT kernel ") + so_path + " does not define " + symbol;
+    return sym;
+}
@@ -0,0 +1,17 @@
+#ifndef JIT_H
+#define JIT_H
+
+#include <string>
+
+//! \brief Compile C++ source into a shared object and return the address of symbol
+//!
+//! The shared object is cached in cache_dir under a hash of the source and the compile command,
+//! so the compiler only runs the first time a given kernel is requested.  The source is
+//! compiled with the same flags and include path as the engine itself.  The compiler may be
+//! overridden with the UPSIDE_JIT_CXX environment variable.  Throws a string on failure.
+void* jit_load_symbol(const std::string& cache_dir, const std::string& source, const std::string& symbol);
+
+//! \brief Decimal representation of x that reads back as exactly x
+std::string jit_float_literal(float x);
+
+#endif
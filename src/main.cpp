@@ -4,6 +4,7 @@
 #include <tclap/CmdLine.h>
 #include "deriv_engine.h"
 #include "timing.h"
+#include "arena.h"
 #include "thermostat.h"
 #include <chrono>
 #include <algorithm>
@@ -96,13 +97,16 @@ struct System {
     float initial_temperature;
     float temperature;
     H5Obj config;
+    string output_path; // group for this system's output within config
     shared_ptr<H5Logger> logger;
+    unique_ptr<EngineArena> arena; // backing memory for engine buffers, so it must outlive engine
     DerivEngine engine;
     MultipleMonteCarloSampler mc_samplers;
     VecArrayStorage mom; // momentum
     OrnsteinUhlenbeckThermostat thermostat;
     uint64_t round_num;
-    System(): round_num(0) {}
+    bool arena_touched; // arena was re-touched by a thread of the main loop (see EngineArena::first_touch)
+    System(): round_num(0), arena_touched(false) {}
 
     void set_temperature(float new_temp) {
         temperature = new_temp;
@@ -234,7 +238,7 @@ struct ReplicaExchange {
         auto compute_log_boltzmann = [&]() {
             vector<float> result(n_system);
             for(int i=0; i<n_system; ++i) {
-                systems[i].engine.compute(PotentialAndDerivMode);
+                systems[i].engine.compute(PotentialOnlyMode);
                 result[i] = -beta[i]*systems[i].engine.potential;
             }
             return result;
@@ -372,6 +376,17 @@ try {
             "of the potential for the initial structure.  This may give strange answers for native structures "
             "(no steric clashes may given an agreement of NaN) or random structures (where bonds and angles are "
             "exactly at their equilibrium values).  Interpret these results at your own risk.", cmd, false);
+    ValueArg<int> threads_per_system_arg("", "threads-per-system", 
+            "number of threads used to evaluate independent potential terms of a single system concurrently "
+            "(default 1).  Systems are still distributed over the remaining OpenMP threads.",
+            false, 1, "int", cmd);
+    SwitchArg huge_pages_arg("", "huge-pages",
+            "Advise the kernel to back engine buffers with transparent huge pages", 
+            cmd, false);
+    ValueArg<string> jit_cache_arg("", "jit-cache",
+            "directory in which to compile and cache kernels specialized to the loaded potential "
+            "(default none, which disables specialization).  The first run of a new potential pays "
+            "a one-time compile cost.", false, "", "path", cmd);
     ValueArg<string> set_param_arg("", "set-param", "Developer use only", false, "", "param_arg", cmd);
     UnlabeledMultiArg<string> config_args("config_files","configuration .h5 files", true, "h5_files");
     cmd.add(config_args);
@@ -417,11 +432,37 @@ try {
 
         int duration_print_width = ceil(log(1+duration)/log(10));
 
+        int threads_per_system = threads_per_system_arg.getValue();
+        if(threads_per_system<1) throw string("--threads-per-system must be at least 1");
+        int n_system_threads = 1;
+#if defined(_OPENMP)
+        // each system may open its own nested parallel region
+        if(threads_per_system>1) omp_set_max_active_levels(2);
+        n_system_threads = max(1, omp_get_max_threads()/threads_per_system);
+#endif
+
         bool do_recenter = !disable_recenter_arg.getValue();
         bool xy_recenter_only = do_recenter && disable_z_recenter_arg.getValue();
 
         h5_noerr(H5Eset_auto(H5E_DEFAULT, nullptr, nullptr));
-        vector<string> config_paths = config_args.getValue();
+        // A config file whose /input/pos has n_system>1 expands into one system per replica
+        vector<string> config_paths;
+        vector<int> config_replica, config_n_replica;
+        for(const string& path: config_args.getValue()) {
+            H5Obj config;
+            try {
+                config = h5_obj(H5Fclose, H5Fopen(path.c_str(), H5F_ACC_RDONLY, H5P_DEFAULT));
+            } catch(string &s) {
+                throw string("Unable to open configuration file at ") + path;
+            }
+            int n_replica = get_dset_size(3, config.get(), "/input/pos")[2];
+            if(n_replica<1) throw string("must have at least one system in /input/pos of ") + path;
+            for(int nr: range(n_replica)) {
+                config_paths.push_back(path);
+                config_replica.push_back(nr);
+                config_n_replica.push_back(n_replica);
+            }
+        }
         vector<System> systems(config_paths.size());
 
         auto temperature_strings = split_string(temperature_arg.getValue(), ",");
@@ -463,17 +504,30 @@ try {
             System* sys = &systems[ns];  // a pointer here makes later lambda's more natural
             sys->random_seed = base_random_seed + ns;
 
-            try {
-                sys->config = h5_obj(H5Fclose,
-                        H5Fopen(config_paths[ns].c_str(), H5F_ACC_RDWR, H5P_DEFAULT));
-            } catch(string &s) {
-                throw string("Unable to open configuration file at ") + config_paths[ns];
+            int replica = config_replica[ns];
+            if(replica) {
+                // later replicas of a multi-system config share the file of the first
+                sys->config = duplicate_obj(systems[ns-1].config);
+            } else {
+                try {
+                    sys->config = h5_obj(H5Fclose,
+                            H5Fopen(config_paths[ns].c_str(), H5F_ACC_RDWR, H5P_DEFAULT));
+                } catch(string &s) {
+                    throw string("Unable to open configuration file at ") + config_paths[ns];
+                }
+
+                if(h5_exists(sys->config.get(), "output")) {
+                    // Note that it is not possible in HDF5 1.8.x to reclaim space by deleting
+                    // datasets or groups.  Subsequent h5repack will reclaim space, however.
+                    h5_noerr(H5Ldelete(sys->config.get(), "/output", H5P_DEFAULT));
+                }
             }
 
-            if(h5_exists(sys->config.get(), "output")) {
-                // Note that it is not possible in HDF5 1.8.x to reclaim space by deleting
-                // datasets or groups.  Subsequent h5repack will reclaim space, however.
-                h5_noerr(H5Ldelete(sys->config.get(), "/output", H5P_DEFAULT));
+            // each replica of a multi-system config logs to its own subgroup of /output
+            sys->output_path = "/output";
+            if(config_n_replica[ns]>1) {
+                ensure_group(sys->config.get(), "output");
+                sys->output_path += "/system_" + to_string(replica);
             }
 
             LogLevel log_level;
@@ -483,10 +537,10 @@ try {
             else if(log_level_arg.getValue() == "extensive") log_level = LOG_EXTENSIVE;
             else throw string("Illegal value for --log-level");
 
-            sys->logger = make_shared<H5Logger>(sys->config, "output", log_level);
+            sys->logger = make_shared<H5Logger>(sys->config, sys->output_path.c_str(), log_level);
             default_logger = sys->logger;  // FIXME kind of a hack for the ugly global variable
 
-            write_string_attribute(sys->config.get(), "output", "invocation", invocation);
+            write_string_attribute(sys->config.get(), sys->output_path.c_str(), "invocation", invocation);
 
             auto pos_shape = get_dset_size(3, sys->config.get(), "/input/pos");
             sys->n_atom = pos_shape[0];
@@ -494,19 +548,30 @@ try {
             for(int d: range(3)) for(int na: range(sys->n_atom)) sys->mom(d,na) = 0.f;
 
             if(pos_shape[1]!=3) throw string("invalid dimensions for initial position");
-            if(pos_shape[2]!=1) throw string("must have n_system 1 from config");
 
             auto potential_group = open_group(sys->config.get(), "/input/potential");
-            sys->engine = initialize_engine_from_hdf5(sys->n_atom, potential_group.get());
+            sys->arena.reset(new EngineArena(huge_pages_arg.getValue()));
+            {
+                ArenaScope arena_scope(sys->arena.get());
+                sys->engine = initialize_engine_from_hdf5(sys->n_atom, potential_group.get());
+                sys->engine.set_n_threads(threads_per_system);
+            }
 
             // Override parameters as instructed by users
             for(const auto& p: set_param_map)
                 sys->engine.get(p.first).computation->set_param(p.second);
 
-            traverse_dset<3,float>(sys->config.get(), "/input/pos", [&](size_t na, size_t d, size_t ns, float x) { 
-                    sys->engine.pos->output(d,na) = x;});
+            // specialized kernels include the parameters, so this must follow set_param
+            if(jit_cache_arg.getValue().size())
+                sys->engine.jit_specialize(jit_cache_arg.getValue());
+
+            traverse_dset<3,float>(sys->config.get(), "/input/pos", [&](size_t na, size_t d, size_t nr, float x) { 
+                    if(int(nr)==replica) sys->engine.pos->output(d,na) = x;});
 
-            if(verbose) printf("%s\nn_atom %i\n\n", config_paths[ns].c_str(), sys->n_atom);
+            if(verbose) {
+                if(config_n_replica[ns]>1) printf("%s (system %i)\nn_atom %i\n\n", config_paths[ns].c_str(), replica, sys->n_atom);
+                else                       printf("%s\nn_atom %i\n\n",             config_paths[ns].c_str(),          sys->n_atom);
+            }
 
             if(potential_deriv_agreement_arg.getValue()){
                 sys->engine.compute(PotentialAndDerivMode);
@@ -620,11 +685,28 @@ try {
         // we need to run everyone until the next synchronization event
         // a little care is needed if we are multiplexing the events
         auto tstart = chrono::high_resolution_clock::now();
+
         while(systems[0].round_num < n_round && received_signal==NO_SIGNAL) {
             int last_start = systems[0].round_num;
-            #pragma omp parallel for schedule(static,1)
+            #pragma omp parallel for schedule(static,1) num_threads(n_system_threads)
             for(int ns=0; ns<int(systems.size()); ++ns) {
                 System& sys = systems[ns];
+
+                // Buffers that grow during the run (pairlist edges, rotamer edges) are reallocated
+                // from the arena of the system when they grow on this thread.  Growth inside the
+                // OpenMP tasks of a system with --threads-per-system>1 may run on another thread
+                // and still uses the heap.
+                ArenaScope arena_scope(sys.arena.get());
+
+                // Engines were initialized serially, so the arena is re-touched by the thread that
+                // runs the system.  The pages only stay local to that thread if OpenMP threads
+                // are bound to cores (e.g. OMP_PROC_BIND=true), since otherwise neither the
+                // thread nor its assignment to systems in later rounds is fixed.
+                if(!sys.arena_touched) {
+                    sys.arena->first_touch();
+                    sys.arena_touched = true;
+                }
+
                 for(bool do_break=false; (!do_break) && (sys.round_num<n_round); ++sys.round_num) {
                     int nr = sys.round_num;
 
@@ -708,9 +790,10 @@ try {
         for(auto& sys: systems) {
             double sum_kinetic = 0.;
             long n_kinetic = 0l;
-            size_t tot_frames = get_dset_size(2, sys.config.get(), "/output/kinetic")[0];
+            auto kinetic_path = sys.output_path + "/kinetic";
+            size_t tot_frames = get_dset_size(2, sys.config.get(), kinetic_path.c_str())[0];
 
-            traverse_dset<2,float>(sys.config.get(),"/output/kinetic", [&](size_t nf, size_t ns, float x){
+            traverse_dset<2,float>(sys.config.get(), kinetic_path.c_str(), [&](size_t nf, size_t ns, float x){
                     if(nf>tot_frames/2){ sum_kinetic+=x; n_kinetic++; }
                     });
             if(verbose) printf(" % .3f", sum_kinetic/n_kinetic / (1.5*sys.temperature));
@@ -723,7 +806,7 @@ try {
                 if(verbose)printf("pivot_success:\n");
                 for(auto& sys: systems) {
                     std::vector<int64_t> ps(2,0);
-                    traverse_dset<2,int>(sys.config.get(), "/output/pivot_stats", [&](size_t nf, int d, int x) {
+                    traverse_dset<2,int>(sys.config.get(), (sys.output_path+"/pivot_stats").c_str(), [&](size_t nf, int d, int x) {
                             ps[d] += x;});
                     if(verbose)printf(" % .4f", double(ps[0])/double(ps[1]));
                 }
@@ -736,7 +819,7 @@ try {
                 if(verbose)printf("jump_success:\n");
                 for(auto& sys: systems) {
                     std::vector<int64_t> ps(2,0);
-                    traverse_dset<2,int>(sys.config.get(), "/output/jump_stats", [&](size_t nf, int d, int x) {
+                    traverse_dset<2,int>(sys.config.get(), (sys.output_path+"/jump_stats").c_str(), [&](size_t nf, int d, int x) {
                             ps[d] += x;});
                     if(verbose)printf(" % .4f", double(ps[0])/double(ps[1]));
                 }
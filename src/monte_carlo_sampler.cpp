@@ -266,12 +266,12 @@ void MonteCarloSampler::monte_carlo_step(
     VecArrayStorage pos_copy(pos);
     float delta_lprob;
 
-    engine.compute(PotentialAndDerivMode);
+    engine.compute(PotentialOnlyMode);
     float old_potential = engine.potential;
 
     propose_random_move(&delta_lprob, random, pos);
 
-    engine.compute(PotentialAndDerivMode);
+    engine.compute(PotentialOnlyMode);
     float new_potential = engine.potential;
 
     float lboltz_diff = delta_lprob - (1.f/temperature) * (new_potential-old_potential);
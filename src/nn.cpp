@@ -30,6 +30,7 @@ struct BackboneFeaturizer : public CoordNode
         hbond(hbond_),
         params(n_elem)
     {
+        check_layout(rama, Layout::SoA);
         check_size(grp, "rama_idx", n_elem);
         check_size(grp, "hbond_idx", n_elem, 2);
 
@@ -42,7 +43,7 @@ struct BackboneFeaturizer : public CoordNode
     }
 
     virtual void compute_value(ComputeMode mode) override {
-        VecArray ramac = rama.output;
+        VecArraySoA ramac(rama.output);
         VecArray hbondc = hbond.output;
 
         for(int ne=0; ne<n_elem; ++ne) {
@@ -63,7 +64,7 @@ struct BackboneFeaturizer : public CoordNode
     }
 
     virtual void propagate_deriv() override {
-        VecArray rama_s = rama.sens;
+        VecArraySoA rama_s(rama.sens);
         VecArray hbond_s = hbond.sens;
 
         for(int ne=0; ne<n_elem; ++ne) {
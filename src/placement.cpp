@@ -40,6 +40,7 @@ struct RamaPlacement {
                 get_dset_size(4, grp, "placement_data")[2]),
         rama_deriv(2*n_pos_dim, n_elem) // first is all phi deriv then all psi deriv
     {
+        check_layout(rama, Layout::SoA);
         check_size(grp, "layer_index",    n_elem);
         check_size(grp, "rama_residue",   n_elem);
         check_size(grp, "placement_data", spline.n_layer, spline.nx, spline.ny, n_pos_dim);
@@ -62,7 +63,7 @@ struct RamaPlacement {
         const float scale_y = spline.ny * (0.5f/M_PI_F - 1e-7f);
         const float shift = M_PI_F;
 
-        VecArray rama_pos   = rama.output;
+        VecArraySoA rama_pos(rama.output);
 
         auto r   = load_vec<2>(rama_pos,   params[ne].rama_residue);
 
@@ -81,7 +82,7 @@ struct RamaPlacement {
         const float scale_x = spline.nx * (0.5f/M_PI_F - 1e-7f);
         const float scale_y = spline.ny * (0.5f/M_PI_F - 1e-7f);
 
-        VecArray r_sens = rama.sens;
+        VecArraySoA r_sens(rama.sens);
 
         auto my_rama_deriv = load_vec<2*n_pos_dim>(rama_deriv, ne);
         auto rd = make_vec2(
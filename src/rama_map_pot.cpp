@@ -34,6 +34,7 @@ struct RamaMapPot : public PotentialNode
         log_pot(read_attribute<int>(grp,".","log_pot",1))
     {
         auto& r = rama_map_data;
+        check_layout(rama, Layout::SoA);
         check_size(grp, "residue_id",     n_residue);
         check_size(grp, "rama_map_id",    n_residue);
         check_size(grp, "rama_pot",       r.n_layer, r.nx, r.ny);
@@ -57,9 +58,9 @@ struct RamaMapPot : public PotentialNode
     virtual void compute_value(ComputeMode mode) override {
         Timer timer(string("rama_map_pot"));
 
-        float* pot = mode==PotentialAndDerivMode ? &potential : nullptr;
-        VecArray ramac     = rama.output;
-        VecArray rama_sens = rama.sens;
+        float* pot = potential_needed(mode) ? &potential : nullptr;
+        VecArraySoA ramac    (rama.output);
+        VecArraySoA rama_sens(rama.sens);
         if(pot) *pot = 0.f;
 
         // add a litte paranoia to make sure there are no rounding problems
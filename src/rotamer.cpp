@@ -134,10 +134,10 @@ struct PaddedMatrix {
 struct EdgeLocator {
     protected:
         int data_size;   // 2*max_partners, must be divisible by 8
-        unique_ptr<int32_t[]> locs;
+        aligned_array<int32_t> locs;
 
         void resize(int new_data_size) {
-            auto new_locs = unique_ptr<int32_t[]>(new_aligned<int32_t>(n_elem1*new_data_size,4));
+            auto new_locs = aligned_array<int32_t>(new_aligned<int32_t>(n_elem1*new_data_size,4));
 
             int copy_size = min(data_size, new_data_size);
             for(int ne=0; ne<n_elem1; ++ne) {
@@ -203,6 +203,18 @@ struct EdgeLocator {
             resize(2*data_size);
             return find_or_insert(result, i1,i2);
         }
+
+        // Index of the edge (i1,i2), or -1 if it was never inserted
+        int32_t find(int32_t i1, int32_t i2) const {
+            const int* partner_array = locs.get() + i1*data_size;
+            for(int j=0; j<data_size; j+=8) {
+                for(int k=0; k<4; ++k) {
+                    if(partner_array[j+k] == i2) return partner_array[j+4+k];
+                    if(partner_array[j+k] == -1) return -1;
+                }
+            }
+            return -1;
+        }
 };
 
 
@@ -216,7 +228,14 @@ struct NodeHolder {
     VecArrayStorage cur_belief;
     VecArrayStorage old_belief;
 
-    unique_ptr<float[]> energy_offset;
+    aligned_array<float> energy_offset;
+
+    // Messages from the edges into each node, in the order they are multiplied into its belief:
+    // message k is at msg_offset[k] in the cur_belief of edge set msg_set[k], for k in
+    // [msg_start[nn], msg_start[nn+1])
+    vector<int32_t> msg_start;
+    vector<int32_t> msg_set;
+    vector<int32_t> msg_offset;
 
     NodeHolder(int n_rot_, int n_elem_):
         n_rot(n_rot_),
@@ -255,6 +274,24 @@ struct NodeHolder {
         }
     }
 
+    // New beliefs of the nodes [nn_start,nn_end) from their probabilities and the messages of the
+    // edges, where msg_base[set] is the cur_belief of edge set set
+    template <int N_ROT>
+        void update_beliefs(int nn_start, int nn_end, float* const* msg_base) {
+            constexpr const int w = (N_ROT+3)/4;
+            for(int nn=nn_start; nn<nn_end; ++nn) {
+                auto b = read4vec<w>(prob.x + nn*4*w);
+                for(int k=msg_start[nn]; k<msg_start[nn+1]; ++k) {
+                    b = read4vec<w>(msg_base[msg_set[k]] + msg_offset[k]) * b;
+
+                    // node normalization is needed for avoid NaN
+                    // FIXME investigate edge scalings that could obviate this
+                    b *= rcp(sum(b).sum_in_all_entries());
+                }
+                store4vec<w>(cur_belief.x + nn*4*w, b);
+            }
+        }
+
     template <int N_ROT>
         void standardize_belief_update(float damping) {
             if(damping != 0.f) {
@@ -313,41 +350,84 @@ struct EdgeHolder {
     public:
         struct EdgeLoc {int edge_num, dim, ne;};
 
+        // The per-edge arrays hold capacity edges (plus 3 so that SIMD loops can read past the
+        // last edge) and grow as edges are added, up to max_n_edge, so their size follows the
+        // edges actually present rather than all possible pairs.
+        int max_n_edge;
+        int capacity;
+
         // FIXME include numerical stability data (basically scale each probability in a sane way)
         VecArrayStorage prob;
         VecArrayStorage cur_belief;
         VecArrayStorage old_belief;
         VecArrayStorage marginal;
 
-        unique_ptr<int[]> edge_indices1;
-        unique_ptr<int[]> edge_indices2;
+        aligned_array<int> edge_indices1;
+        aligned_array<int> edge_indices2;
         // unordered_map<unsigned,unsigned> nodes_to_edge;
         EdgeLocator nodes_to_edge;
+        EdgeLocator solved_edges;  // nodes_to_edge before the last reset, which indexes the last messages
         vector<EdgeLoc> edge_loc;
 
-        EdgeHolder(NodeHolder &nodes1_, NodeHolder &nodes2_, int max_n_edge):
+        EdgeHolder(NodeHolder &nodes1_, NodeHolder &nodes2_, int max_n_edge_):
             n_rot1(nodes1_.n_rot), n_rot2(nodes2_.n_rot),
             nodes1(nodes1_), nodes2(nodes2_),
-            prob      (n_rot1*ru(n_rot2),     max_n_edge+3),
-            cur_belief(ru(n_rot1)+ru(n_rot2), max_n_edge+3),
-            old_belief(ru(n_rot1)+ru(n_rot2), max_n_edge+3),
-            marginal(n_rot1*n_rot2,           max_n_edge+3), // the +1 ensures we can write past the end
-
-            edge_indices1(new_aligned<int>(max_n_edge,simd_width)),
-            edge_indices2(new_aligned<int>(max_n_edge,simd_width)),
-
-            nodes_to_edge(nodes1.n_elem)
+            max_n_edge(max_n_edge_),
+            capacity(initial_edge_capacity(nodes1_.n_elem, nodes2_.n_elem, max_n_edge)),
+            prob      (n_rot1*ru(n_rot2),     capacity+3),
+            cur_belief(ru(n_rot1)+ru(n_rot2), capacity+3),
+            old_belief(ru(n_rot1)+ru(n_rot2), capacity+3),
+            marginal(n_rot1*n_rot2,           capacity+3), // the +1 ensures we can write past the end
+
+            edge_indices1(new_aligned<int>(capacity,simd_width)),
+            edge_indices2(new_aligned<int>(capacity,simd_width)),
+
+            nodes_to_edge(nodes1.n_elem),
+            solved_edges (nodes1.n_elem)
         {
 
-            edge_loc.reserve(n_rot1*n_rot2*max_n_edge);
+            edge_loc.reserve(n_rot1*n_rot2*capacity);
             fill(cur_belief, 0.f);
             fill(old_belief, 0.f);
-            fill_n(edge_indices1, round_up(max_n_edge,simd_width), 0);
-            fill_n(edge_indices2, round_up(max_n_edge,simd_width), 0);
-            nodes_to_edge.n_edge = max_n_edge;
+            fill_n(edge_indices1, capacity, 0);
+            fill_n(edge_indices2, capacity, 0);
+            nodes_to_edge.n_edge = capacity;
             reset();
         }
 
+        // Grow the per-edge arrays to hold n_needed edges.  The contents are kept, since
+        // cur_belief holds the messages of the last solve for a warm start.
+        void reserve(int n_needed) {
+            if(n_needed <= capacity) return;
+            int new_capacity = grow_edge_capacity(capacity, n_needed, max_n_edge);
+
+            auto grow = [&](VecArrayStorage& a, int elem_width) {
+                auto old_x = move(a.x);
+                int old_n_float = a.n_float;
+                a.reset(elem_width, new_capacity+3);
+                fill(a, 0.f);
+                copy_n(old_x.get(), old_n_float, a.x.get());
+            };
+            grow(prob,       n_rot1*ru(n_rot2));
+            grow(cur_belief, ru(n_rot1)+ru(n_rot2));
+            grow(old_belief, ru(n_rot1)+ru(n_rot2));
+            grow(marginal,   n_rot1*n_rot2);
+            resize_aligned(edge_indices1, capacity, new_capacity, simd_width);
+            resize_aligned(edge_indices2, capacity, new_capacity, simd_width);
+
+            // the new edges start as reset leaves them
+            for(int idx=capacity; idx<new_capacity; ++idx) {
+                edge_indices1[idx] = edge_indices2[idx] = 0;
+                for(int i: range(n_rot1))
+                    for(int j: range(n_rot2))
+                        prob(i*ru(n_rot2)+j,idx) = 1.f;
+            }
+            capacity = new_capacity;
+        }
+
+        // The edge tables are rebuilt on every call, even for edges that the interaction graph
+        // reused (see reuse_distance in InteractionGraph), since the edge numbering follows the
+        // pairlist.
         void reset() {
             // reset the probabilities we wrote over
             for(int idx=0; idx<nodes_to_edge.n_edge; ++idx)
@@ -355,17 +435,32 @@ struct EdgeHolder {
                     for(int j: range(n_rot2)) 
                         prob(i*ru(n_rot2)+j,idx) = 1.f;
 
+            // keep the edges of the last solve, since its messages are still in cur_belief
+            swap(nodes_to_edge, solved_edges);
             nodes_to_edge.clear();
             edge_loc.clear();
         }
         void swap_beliefs() { swap(cur_belief, old_belief); }
 
+        // Start belief propagation from uniform messages, or if warm is set, from the messages of
+        // the last solve for the edges that were present then
+        void start_beliefs(bool warm) {
+            for(int ne: range(nodes_to_edge.n_edge)) {
+                int32_t prev = warm ? solved_edges.find(edge_indices1[ne], edge_indices2[ne]) : -1;
+                for(int d: range(ru(n_rot1)+ru(n_rot2))) {
+                    bool in_use = d<ru(n_rot1) ? d<n_rot1 : d-ru(n_rot1)<n_rot2;
+                    old_belief(d,ne) = prev>=0 ? cur_belief(d,prev) : float(in_use);
+                }
+            }
+        }
+
         void add_to_edge(
                 int ne, float prob_val,
                 unsigned id1, unsigned rot1, 
                 unsigned id2, unsigned rot2) {
             int32_t idx;
             if(nodes_to_edge.find_or_insert(idx,id1,id2)){
+                reserve(idx+1);
                 edge_indices1[idx] = id1;
                 edge_indices2[idx] = id2;
             }
@@ -450,22 +545,25 @@ struct EdgeHolder {
             return en;
         }
 
+        // Offset in cur_belief of the message of edge ne to its first (side 0) or second node
+        int message_offset(int ne, int side) const {
+            return ne*(ru(n_rot1)+ru(n_rot2)) + side*ru(n_rot1);
+        }
+
+        // New messages of the edges [ne_start,ne_end) from the old node and edge beliefs.  The
+        // messages are left unnormalized in cur_belief, since the nodes multiply them into their
+        // beliefs (NodeHolder::update_beliefs) before normalize_beliefs is called.
         template <int N_ROT1, int N_ROT2>
-            void update_beliefs() {
+            void update_beliefs(int ne_start, int ne_end) {
                 constexpr const int w1 = (N_ROT1+3)/4;
                 constexpr const int w2 = (N_ROT2+3)/4;
                 constexpr const int ws = w1+w2;
                 // horizontal SIMD implementation of update_beliefs for N_ROT1==N_ROT2==3
 
                 float* vec_old_node_belief1 = nodes1.old_belief.x.get();
-                float* vec_cur_node_belief1 = nodes1.cur_belief.x.get();
-
                 float* vec_old_node_belief2 = nodes2.old_belief.x.get();
-                float* vec_cur_node_belief2 = nodes2.cur_belief.x.get();
-
-                int n_edge = nodes_to_edge.n_edge;
 
-                for(int ne=0; ne<n_edge; ++ne) {
+                for(int ne=ne_start; ne<ne_end; ++ne) {
                     int i1 = edge_indices1[ne]*4*w1;
                     int i2 = edge_indices2[ne]*4*w2;
 
@@ -483,27 +581,23 @@ struct EdgeHolder {
                     auto cur_edge_belief1 = eprob.apply_left (v2);
                     auto cur_edge_belief2 = eprob.apply_right(v1);
 
-                    auto cur_node_belief1 = cur_edge_belief1 * read4vec<w1>(vec_cur_node_belief1 + i1);
-                    auto cur_node_belief2 = cur_edge_belief2 * read4vec<w2>(vec_cur_node_belief2 + i2);
-                    
-                    // node normalization is needed for avoid NaN
-                    // FIXME investigate edge scalings that could obviate this
-                    // FIXME investigate scaling the edges only every N somethings to reduce expense
-                    cur_node_belief1 *= rcp(sum(cur_node_belief1).sum_in_all_entries());
-                    cur_node_belief2 *= rcp(sum(cur_node_belief2).sum_in_all_entries());
-
                     store4vec<w1>(cur_belief.x + ne*4*ws + 0,    cur_edge_belief1);
                     store4vec<w2>(cur_belief.x + ne*4*ws + 4*w1, cur_edge_belief2);
-                    store4vec<w1>(vec_cur_node_belief1 + i1,     cur_node_belief1);
-                    store4vec<w2>(vec_cur_node_belief2 + i2,     cur_node_belief2);
                 }
+            }
+
+        // Perform edge normalization for the edges [ne_start,ne_end), where ne_start is even
+        // We could perform it in update_beliefs, but it would insert a long dependency chain in the
+        // middle of the algorithm.  The hope is that the processor will expose much more instruction
+        // parallelism in this loop.  The loop process 2 edges at a time to fully utilize the horizontal
+        // adds.
+        template <int N_ROT1, int N_ROT2>
+            void normalize_beliefs(int ne_start, int ne_end) {
+                constexpr const int w1 = (N_ROT1+3)/4;
+                constexpr const int w2 = (N_ROT2+3)/4;
+                constexpr const int ws = w1+w2;
 
-                // Perform edge normalization for all edges
-                // We could perform it in the loop above, but it would insert a long dependency chain in the 
-                // middle of the algorithm.  The hope is that the processor will expose much more instruction
-                // parallelism in this loop.  The loop process 2 edges at a time to fully utilize the horizontal
-                // adds.
-                for(int ne=0; ne<n_edge; ne+=2) {
+                for(int ne=ne_start; ne<ne_end; ne+=2) {
                     auto cb11 = read4vec<w1>(cur_belief.x + ne*4*ws + 0);
                     auto cb12 = read4vec<w2>(cur_belief.x + ne*4*ws + 4*w1);
                     auto cb21 = read4vec<w1>(cur_belief.x + ne*4*ws + 4*ws);
@@ -589,7 +683,7 @@ struct RotamerSidechain: public PotentialNode {
     NodeHolder  nodes1, nodes3, nodes6; // FIXME initialize these with sane max_n_edge
 
     EdgeHolder* edge_holders_matrix[UPPER_ROT][UPPER_ROT];
-    EdgeHolder edges11, edges13, edges16, edges33, edges36, edges66; // FIXME initialize these with sane max_n_edge
+    EdgeHolder edges11, edges13, edges16, edges33, edges36, edges66; // sized by all pairs, but grown only as needed
 
     float energy_cap;
     float energy_cap_width;
@@ -598,6 +692,12 @@ struct RotamerSidechain: public PotentialNode {
     int   max_iter;
     float tol;
     int   iteration_chunk_size;
+    int   n_threads;
+
+    // If warm_start is set, each solve starts from the beliefs of the last one if it converged,
+    // since the geometry changes little between calls
+    bool  warm_start;
+    bool  last_solve_converged;
 
     bool energy_fresh_relative_to_derivative;
 
@@ -631,6 +731,9 @@ struct RotamerSidechain: public PotentialNode {
         max_iter(read_attribute<int  >(grp, ".", "max_iter")),
         tol     (read_attribute<float>(grp, ".", "tol")),
         iteration_chunk_size(read_attribute<int>(grp, ".", "iteration_chunk_size")),
+        n_threads(1),
+        warm_start(read_attribute<int>(grp, ".", "warm_start", 0)),
+        last_solve_converged(false),
 
         energy_fresh_relative_to_derivative(false),
         n_bad_solve(0)
@@ -777,20 +880,27 @@ struct RotamerSidechain: public PotentialNode {
     }
 
     virtual void compute_value(ComputeMode mode) override {
-        energy_fresh_relative_to_derivative = mode==PotentialAndDerivMode;
-
-        fill_holders();
-        auto solve_results = solve_for_marginals();
+        energy_fresh_relative_to_derivative = potential_needed(mode);
+
+        fill_holders(deriv_needed(mode));
+        bool warm = warm_start && last_solve_converged;
+        auto solve_results = solve_for_marginals(warm);
+        // a warm start that fails to converge is retried from the usual starting beliefs
+        if(warm && !(solve_results.second <= tol)) solve_results = solve_for_marginals(false);
+        last_solve_converged = solve_results.second <= tol;
         if(solve_results.first >= max_iter - iteration_chunk_size - 1)
             n_bad_solve++;
 
-        propagate_derivatives();
-        if(mode==PotentialAndDerivMode) potential = calculate_energy_from_marginals();
+        if(deriv_needed(mode)) propagate_derivatives();
+        if(potential_needed(mode)) potential = calculate_energy_from_marginals();
     }
 
     virtual double test_value_deriv_agreement() {return -1.;}
 
-    void fill_holders()
+    // A warm-started solve depends on the beliefs of the previous call, not only on the inputs
+    virtual bool memoizable() const override {return !warm_start;}
+
+    void fill_holders(bool store_deriv=true)
     {
         Timer timer(std::string("rotamer_fill"));
         edges11.reset();
@@ -826,7 +936,7 @@ struct RotamerSidechain: public PotentialNode {
                 node_holders_matrix[n_rot]->convert_energy_to_prob(energy_cap, energy_cap_width);
 
         // Fill edge probabilities
-        igraph.compute_edges();
+        igraph.compute_edges(store_deriv);
 
         const unsigned selector = (1u<<n_bit_rotamer) - 1u;
         for(int ne=0; ne<igraph.n_edge; ++ne) {
@@ -849,6 +959,42 @@ struct RotamerSidechain: public PotentialNode {
         for(int n_rot: range(2,UPPER_ROT))
             if(edge_holders_matrix[1][n_rot])
                 edge_holders_matrix[1][n_rot]->move_edge_prob_to_node2();
+
+        build_message_lists();
+    }
+
+    // The edge sets of the belief propagation, which are the msg_set's of the nodes
+    array<EdgeHolder*,3> bp_edges() {return {{&edges33, &edges36, &edges66}};}
+
+    // List the messages into each node in edge set order, then edge order, so that each node
+    // belief is always multiplied together in the same order
+    void build_message_lists() {
+        auto edge_sets = bp_edges();
+        for(NodeHolder* nh: {&nodes3, &nodes6}) {
+            nh->msg_start.assign(nh->n_elem+1, 0);
+            for(EdgeHolder* eh: edge_sets) {
+                for(int ne: range(eh->nodes_to_edge.n_edge)) {
+                    if(&eh->nodes1 == nh) nh->msg_start[eh->edge_indices1[ne]+1]++;
+                    if(&eh->nodes2 == nh) nh->msg_start[eh->edge_indices2[ne]+1]++;
+                }
+            }
+            for(int nn: range(nh->n_elem)) nh->msg_start[nn+1] += nh->msg_start[nn];
+
+            nh->msg_set   .resize(nh->msg_start.back());
+            nh->msg_offset.resize(nh->msg_start.back());
+            vector<int32_t> next(nh->msg_start.begin(), nh->msg_start.end()-1);
+            for(int set: range(edge_sets.size())) {
+                EdgeHolder* eh = edge_sets[set];
+                for(int ne: range(eh->nodes_to_edge.n_edge)) {
+                    for(int side: range(2)) {
+                        if(&(side ? eh->nodes2 : eh->nodes1) != nh) continue;
+                        int k = next[side ? eh->edge_indices2[ne] : eh->edge_indices1[ne]]++;
+                        nh->msg_set   [k] = set;
+                        nh->msg_offset[k] = eh->message_offset(ne, side);
+                    }
+                }
+            }
+        }
     }
 
     float calculate_energy_from_marginals() {
@@ -985,12 +1131,52 @@ struct RotamerSidechain: public PotentialNode {
     }
 
 
+    // Run f(nc,n_chunk) for each chunk of the belief propagation, as OpenMP tasks if there are
+    // several chunks
+    template <typename F>
+    void for_each_bp_chunk(F&& f) {
+        int n_edge = 0;
+        for(EdgeHolder* eh: bp_edges()) n_edge += eh->nodes_to_edge.n_edge;
+        // a chunk must have enough edges to be worth a task
+        int n_chunk = max(1, min(n_threads, n_edge/512));
+        if(n_chunk>1) {
+            #pragma omp taskloop grainsize(1)
+            for(int nc=0; nc<n_chunk; ++nc) f(nc, n_chunk);
+        } else {
+            f(0, 1);
+        }
+    }
+
+    // Start of chunk nc of [0,n), which is a multiple of multiple unless it is n
+    static int chunk_start(int n, int nc, int n_chunk, int multiple=1) {
+        return min(n, round_up(int(int64_t(n)*nc/n_chunk), multiple));
+    }
+
+    // Each new edge message only depends on the old beliefs, and each node multiplies its messages
+    // in a fixed order, so the edges and then the nodes are updated in parallel without changing
+    // the result.
     void calculate_new_beliefs(float damping_for_this_iteration, bool do_swap_for_initial=false) {
-        copy(nodes3.prob, nodes3.cur_belief);
-        copy(nodes6.prob, nodes6.cur_belief);
-        edges33.update_beliefs<3,3>();
-        edges36.update_beliefs<3,6>();
-        edges66.update_beliefs<6,6>();
+        for_each_bp_chunk([&](int nc, int n_chunk) {
+            auto start = [&](const EdgeHolder& eh, int c) {return chunk_start(eh.nodes_to_edge.n_edge, c, n_chunk);};
+            edges33.update_beliefs<3,3>(start(edges33,nc), start(edges33,nc+1));
+            edges36.update_beliefs<3,6>(start(edges36,nc), start(edges36,nc+1));
+            edges66.update_beliefs<6,6>(start(edges66,nc), start(edges66,nc+1));
+        });
+
+        float* msg_base[3] = {edges33.cur_belief.x.get(), edges36.cur_belief.x.get(), edges66.cur_belief.x.get()};
+        for_each_bp_chunk([&](int nc, int n_chunk) {
+            auto start = [&](const NodeHolder& nh, int c) {return chunk_start(nh.n_elem, c, n_chunk);};
+            nodes3.update_beliefs<3>(start(nodes3,nc), start(nodes3,nc+1), msg_base);
+            nodes6.update_beliefs<6>(start(nodes6,nc), start(nodes6,nc+1), msg_base);
+        });
+
+        // the pairs of edges that are normalized together must be in the same chunk
+        for_each_bp_chunk([&](int nc, int n_chunk) {
+            auto start = [&](const EdgeHolder& eh, int c) {return chunk_start(eh.nodes_to_edge.n_edge, c, n_chunk, 2);};
+            edges33.normalize_beliefs<3,3>(start(edges33,nc), start(edges33,nc+1));
+            edges36.normalize_beliefs<3,6>(start(edges36,nc), start(edges36,nc+1));
+            edges66.normalize_beliefs<6,6>(start(edges66,nc), start(edges66,nc+1));
+        });
 
         if(do_swap_for_initial) {
             // we want the "old" values here
@@ -1002,7 +1188,9 @@ struct RotamerSidechain: public PotentialNode {
     }
     
 
-    pair<int,float> solve_for_marginals() {
+    // If warm is set, start from the marginals and messages of the last solve, which must still be
+    // in the cur_belief arrays
+    pair<int,float> solve_for_marginals(bool warm=false) {
         Timer timer(std::string("rotamer_solve"));
         // first initialize old node beliefs to just be probability
         // this may affect the final answer since belief propagation is minimizing a non-convex function
@@ -1010,26 +1198,9 @@ struct RotamerSidechain: public PotentialNode {
             if(nh)
                 for(int no: range(nh->n_rot))
                     for(int ne: range(nh->n_elem))
-                        nh->old_belief(no,ne) = nh->prob(no,ne);
-
-        alignas(16) float start_belief3 [4] = {1.f,1.f,1.f,0.f}; auto sb3  = Float4(start_belief3);
-        alignas(16) float start_belief6a[4] = {1.f,1.f,1.f,1.f}; auto sb6a = Float4(start_belief6a);
-        alignas(16) float start_belief6b[4] = {1.f,1.f,0.f,0.f}; auto sb6b = Float4(start_belief6b);
-        for(int ne=0; ne<edges33.nodes_to_edge.n_edge; ++ne) {
-            sb3 .store(edges33.old_belief.x+ne*8+0);
-            sb3 .store(edges33.old_belief.x+ne*8+4);
-        }
-        for(int ne=0; ne<edges36.nodes_to_edge.n_edge; ++ne) {
-            sb3 .store(edges36.old_belief.x+ne*12+0);
-            sb6a.store(edges36.old_belief.x+ne*12+4);
-            sb6b.store(edges36.old_belief.x+ne*12+8);
-        }
-        for(int ne=0; ne<edges66.nodes_to_edge.n_edge; ++ne) {
-            sb6a.store(edges66.old_belief.x+ne*16+ 0);
-            sb6b.store(edges66.old_belief.x+ne*16+ 4);
-            sb6a.store(edges66.old_belief.x+ne*16+ 8);
-            sb6b.store(edges66.old_belief.x+ne*16+12);
-        }
+                        nh->old_belief(no,ne) = warm ? nh->cur_belief(no,ne) : nh->prob(no,ne);
+
+        for(EdgeHolder* eh: bp_edges()) eh->start_beliefs(warm);
 
         calculate_new_beliefs(0.f, true);
         float max_deviation = 1e10f;
@@ -1065,6 +1236,11 @@ struct RotamerSidechain: public PotentialNode {
     virtual std::vector<float> get_param_deriv() override {return igraph.get_param_deriv();}
 #endif
     virtual void set_param(const std::vector<float>& new_param) override {igraph.set_param(new_param);}
+    virtual void set_n_threads(int n_threads_) override {
+        n_threads = max(1, n_threads_);
+        igraph.set_n_threads(n_threads);
+    }
+    virtual void jit_specialize(const std::string& cache_dir) override {igraph.jit_specialize(cache_dir);}
 };
 
 template <typename BT>
@@ -90,16 +90,19 @@ struct SidechainRadialPairs : public PotentialNode
     virtual void compute_value(ComputeMode mode) {
         Timer timer(string("radial_pairs"));
 
-        igraph.compute_edges();
-        for(int ne=0; ne<igraph.n_edge; ++ne) igraph.edge_sensitivity[ne] = 1.f;
-        igraph.propagate_derivatives();
+        igraph.compute_edges(deriv_needed(mode));
+        if(deriv_needed(mode)) {
+            for(int ne=0; ne<igraph.n_edge; ++ne) igraph.edge_sensitivity[ne] = 1.f;
+            igraph.propagate_derivatives();
+        }
 
-        if(mode==PotentialAndDerivMode) {
+        if(potential_needed(mode)) {
             potential = 0.f;
             for(int ne=0; ne<igraph.n_edge; ++ne) 
                 potential += igraph.edge_value[ne];
         }
     }
+    virtual void set_n_threads(int n_threads) override {igraph.set_n_threads(n_threads);}
 };
 
 
@@ -116,11 +119,13 @@ struct HBondSidechainRadialPairs : public PotentialNode
     virtual void compute_value(ComputeMode mode) {
         Timer timer(string("hbond_sc_radial_pairs"));
 
-        igraph.compute_edges();
-        for(int ne=0; ne<igraph.n_edge; ++ne) igraph.edge_sensitivity[ne] = 1.f;
-        igraph.propagate_derivatives();
+        igraph.compute_edges(deriv_needed(mode));
+        if(deriv_needed(mode)) {
+            for(int ne=0; ne<igraph.n_edge; ++ne) igraph.edge_sensitivity[ne] = 1.f;
+            igraph.propagate_derivatives();
+        }
 
-        if(mode==PotentialAndDerivMode) {
+        if(potential_needed(mode)) {
             potential = 0.f;
             for(int ne=0; ne<igraph.n_edge; ++ne) 
                 potential += igraph.edge_value[ne];
@@ -132,6 +137,7 @@ struct HBondSidechainRadialPairs : public PotentialNode
     virtual std::vector<float> get_param_deriv() override {return igraph.get_param_deriv();}
 #endif
     virtual void set_param(const std::vector<float>& new_param) override {igraph.set_param(new_param);}
+    virtual void set_n_threads(int n_threads) override {igraph.set_n_threads(n_threads);}
 };
 
 
@@ -4,10 +4,13 @@
 #include <cmath>
 #include <type_traits>
 #include <memory>
+#include <new>
 #include <cstdio>
 #include <cassert>
 #include <algorithm>
+#include <string>
 #include "Float4.h"
+#include "arena.h"
 
 static constexpr int default_alignment=4; // suitable for SSE
 
@@ -25,16 +28,47 @@ constexpr inline int ru(int i) {
 }
 
 
+//! \brief Deleter for new_aligned, which does nothing for memory owned by an EngineArena
+struct AlignedDeleter {
+    bool from_arena;
+    AlignedDeleter(bool from_arena_=false): from_arena(from_arena_) {}
+
+    template <typename T>
+    void operator()(T* ptr) const {if(!from_arena) delete [] ptr;}
+};
+
+template <typename T>
+using aligned_array = std::unique_ptr<T[],AlignedDeleter>;
+
 template <typename T>
-static std::unique_ptr<T[]> new_aligned(int n_elem, int alignment_elems=default_alignment) {
+static aligned_array<T> new_aligned(int n_elem, int alignment_elems=default_alignment) {
     // round up allocation to ensure that you can also read to the end without
     //   overstepping the array, if needed
-    T* ptr = new T[round_up(n_elem, alignment_elems)];
+    int n_alloc = round_up(n_elem, alignment_elems);
+
+    // arena memory is never destroyed element-wise, so only trivially destructible types may use it
+    EngineArena* arena = current_arena();
+    if(arena && std::is_trivially_destructible<T>::value) {
+        T* ptr = static_cast<T*>(arena->allocate(n_alloc*sizeof(T), maxint(64,alignof(T))));
+        for(int i=0; i<n_alloc; ++i) new(ptr+i) T;
+        return aligned_array<T>(ptr, AlignedDeleter(true));
+    }
+
+    T* ptr = new T[n_alloc];
     // printf("aligning %i elements at %p\n", round_up(n_elem, alignment_elems), (void*)ptr);
     // if((unsigned long)(ptr)%(unsigned long)(alignment_elems*sizeof(T))) throw "bad alignment on string";
-    return std::unique_ptr<T[]>(ptr);
+    return aligned_array<T>(ptr);
 }
 
+//! \brief Memory layout of the components of a VecArrayStorage
+//!
+//! In the AoS layout (accessed through VecArray), the components of each element are
+//! contiguous and the element is padded to a multiple of 4 floats, except for width 1.  In the
+//! SoA layout (accessed through VecArraySoA), each component is contiguous across elements and
+//! padded to a multiple of 8 elements, so that SIMD code can load consecutive elements of one
+//! component directly.
+enum class Layout {AoS, SoA};
+
 struct VecArray {
     float* x;
     int row_width;
@@ -54,58 +88,110 @@ struct VecArray {
 };
 
 
+//! \brief View of storage in the SoA layout, where each component is contiguous across elements
+//!
+//! This is a separate type from VecArray so that the AoS indexing used by nearly all code does
+//! not pay for a runtime component stride.
+struct VecArraySoA {
+    float* x;
+    int component_stride;
+
+    VecArraySoA(): x(nullptr), component_stride(0) {}
+
+    VecArraySoA(float* x_, int component_stride_):
+        x(x_), component_stride(component_stride_) {}
+
+    float& operator()(int i_comp, int i_elem) {
+        return x[i_comp*component_stride + i_elem];
+    }
+
+    const float& operator()(int i_comp, int i_elem) const {
+        return x[i_comp*component_stride + i_elem];
+    }
+};
+
+
 struct VecArrayStorage {
     int n_elem;
     int row_width;
-    std::unique_ptr<float[]> x;
-
-    VecArrayStorage(int elem_width_, int n_elem_):
-        n_elem(n_elem_), row_width(ru(elem_width_)),
-        x(new_aligned<float>(n_elem*row_width)) {
-            std::fill_n(x.get(), n_elem*row_width, 0.f);
+    int component_stride;
+    int n_float;
+    aligned_array<float> x;
+
+    VecArrayStorage(int elem_width_, int n_elem_, Layout layout=Layout::AoS):
+        n_elem(n_elem_),
+        row_width       (soa_layout(elem_width_,layout) ? 1                   : ru(elem_width_)),
+        component_stride(soa_layout(elem_width_,layout) ? round_up(n_elem,8) : 1),
+        n_float         (soa_layout(elem_width_,layout) ? elem_width_*component_stride : n_elem*row_width),
+        x(new_aligned<float>(n_float)) {
+            std::fill_n(x.get(), n_float, 0.f);
         }
 
     VecArrayStorage(const VecArrayStorage& o):
-        n_elem(o.n_elem), row_width(o.row_width),
-        x(new_aligned<float>(n_elem*row_width))
+        n_elem(o.n_elem), row_width(o.row_width), component_stride(o.component_stride),
+        n_float(o.n_float), x(new_aligned<float>(n_float))
     {
-        std::copy_n(o.x.get(), n_elem*row_width, x.get());
+        std::copy_n(o.x.get(), n_float, x.get());
     }
 
     VecArrayStorage(): VecArrayStorage(1,1) {}
 
+    // AoS indexing only, so that the common case pays no runtime component stride; SoA storage
+    // is indexed through VecArraySoA
     float& operator()(int i_comp, int i_elem) {
-        return x[i_elem*row_width + i_comp];
+        assert(component_stride==1);
+        return x[i_comp + i_elem*row_width];
     }
 
     const float& operator()(int i_comp, int i_elem) const {
-        return x[i_elem*row_width + i_comp];
+        assert(component_stride==1);
+        return x[i_comp + i_elem*row_width];
+    }
+
+    // a width-1 storage is valid in both layouts; this must not be compiled out with
+    // NDEBUG since AoS indexing of SoA storage silently reads the wrong elements
+    operator VecArray() {
+        if(component_stride!=1) throw std::string("SoA storage cannot be viewed as a VecArray");
+        return VecArray(x.get(), row_width);
     }
 
-    operator VecArray() {return VecArray(x.get(), row_width);}
+    explicit operator VecArraySoA() {
+        assert(row_width==1);
+        return VecArraySoA(x.get(), component_stride);
+    }
+
+    Layout layout() const {return component_stride==1 ? Layout::AoS : Layout::SoA;}
 
     void reset(int elem_width_, int n_elem_) {
-        row_width = ru(elem_width_);
-        n_elem = n_elem_;
-        x.reset(new float[n_elem*row_width]);
+        bool soa = soa_layout(elem_width_, layout());
+        n_elem           = n_elem_;
+        row_width        = soa ? 1                   : ru(elem_width_);
+        component_stride = soa ? round_up(n_elem,8) : 1;
+        n_float          = soa ? elem_width_*component_stride : n_elem*row_width;
+        x = new_aligned<float>(n_float);
     }
+
+    // a single component is laid out identically in either layout
+    static bool soa_layout(int elem_width, Layout layout) {return layout==Layout::SoA && elem_width>1;}
 };
 
 
 static void copy(VecArrayStorage& v_src, VecArrayStorage& v_dst) {
     assert(v_src.n_elem    == v_dst.n_elem);
+    assert(v_src.n_float   == v_dst.n_float);
     assert(v_src.row_width == v_dst.row_width);
-    std::copy_n(v_src.x.get(), v_src.n_elem*v_src.row_width, v_dst.x.get()); 
+    std::copy_n(v_src.x.get(), v_src.n_float, v_dst.x.get());
 }
 
 inline void swap(VecArrayStorage& a, VecArrayStorage& b) {
     assert(a.n_elem==b.n_elem);
+    assert(a.n_float==b.n_float);
     assert(a.row_width==b.row_width);
     a.x.swap(b.x);
 }
 
 static void fill(VecArrayStorage& v, float fill_value) {
-    std::fill_n(v.x.get(), v.n_elem*v.row_width, fill_value);
+    std::fill_n(v.x.get(), v.n_float, fill_value);
 }
 
 static void fill(VecArray v, int n_dim, int n_elem, float fill_value) {
@@ -223,6 +309,20 @@ inline void store_vec(float* a, const Vec<D,Float4>& r, Alignment align=Alignmen
     for(int d=0; d<D; ++d) r[d].store(a+4*d, align);
 }
 
+template <int D>
+inline Vec<D,float> load_vec(const VecArraySoA& a, int idx) {
+    Vec<D,float> r;
+    #pragma unroll
+    for(int d=0; d<D; ++d) r[d] = a(d,idx);
+    return r;
+}
+
+template <int D>
+inline void store_vec(VecArraySoA& a, int idx, const Vec<D,float>& r) {
+    #pragma unroll
+    for(int d=0; d<D; ++d) a(d,idx) = r[d];
+}
+
 template <int D, typename multype>
 inline void update_vec_scale(VecArray a, int idx, const multype &r) {
     store_vec(a,idx, load_vec<D>(a,idx) * r);